@@ -1,11 +1,223 @@
+// Build: g++ -std=c++17 -O2 main.cpp -lsqlite3 -lz -lcrypto -o main
+// Optional codecs: -DMAIL_BROTLI_SUPPORT -lbrotlienc, -DMAIL_ZSTD_SUPPORT -lzstd
+
+// The inbox polls every 10 s, past httplib's 5 s keep-alive, so each poll
+// is a new connection; with httplib's backlog of 5 a burst of them overflows
+// the accept queue and the clients wait out a 1 s SYN retry.
+#ifndef CPPHTTPLIB_LISTEN_BACKLOG
+#define CPPHTTPLIB_LISTEN_BACKLOG 1024
+#endif
 #include "httplib.h"
 #include "json.hpp"
 #include "sqlite3.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef MAIL_BROTLI_SUPPORT
+#include <brotli/encode.h>
+#endif
+#ifdef MAIL_ZSTD_SUPPORT
+#include <zstd.h>
+#endif
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 
 using json = nlohmann::json;
 
+size_t envOr(const char *name, size_t fallback) {
+  const char *value = std::getenv(name);
+  if (value == nullptr || *value == '\0')
+    return fallback;
+  try {
+    return std::stoul(value);
+  } catch (const std::exception &) {
+    std::cerr << "Ignoring invalid " << name << "=" << value << '\n';
+    return fallback;
+  }
+}
+
+class ExecutorBusy : public std::runtime_error {
+public:
+  explicit ExecutorBusy(const std::string &name)
+      : std::runtime_error(name + " executor queue is full") {}
+};
+
+// Fixed-size worker pool with a bounded queue. submit() never blocks: when
+// the queue is full it throws ExecutorBusy so callers can shed the request
+// instead of piling up behind a slow job.
+class Executor {
+private:
+  std::string name;
+  size_t max_queued;
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> jobs;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool stopping = false;
+  std::function<void(std::chrono::steady_clock::duration)> observer;
+
+  void run() {
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (stopping && jobs.empty())
+          return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      job();
+    }
+  }
+
+public:
+  Executor(std::string name, size_t threads, size_t max_queued)
+      : name(std::move(name)), max_queued(max_queued) {
+    if (threads == 0)
+      threads = 1;
+    workers.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+      workers.emplace_back([this] { run(); });
+  }
+
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  ~Executor() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &t : workers)
+      t.join();
+  }
+
+  template <typename F>
+  auto submit(F &&fn) -> std::future<std::invoke_result_t<F>> {
+    using R = std::invoke_result_t<F>;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+    auto result = task->get_future();
+    auto queued_at = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (stopping || jobs.size() >= max_queued)
+        throw ExecutorBusy(name);
+      jobs.emplace_back([this, task, queued_at] {
+        (*task)();
+        if (observer)
+          observer(std::chrono::steady_clock::now() - queued_at);
+      });
+    }
+    cv.notify_one();
+    return result;
+  }
+
+  template <typename F> auto run(F &&fn) {
+    return submit(std::forward<F>(fn)).get();
+  }
+
+  size_t queued() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return jobs.size();
+  }
+
+  size_t threads() const { return workers.size(); }
+
+  const std::string &getName() const { return name; }
+
+  // Called with queue wait plus run time of every job. Must be set before
+  // the first submit().
+  void observe(std::function<void(std::chrono::steady_clock::duration)> fn) {
+    observer = std::move(fn);
+  }
+
+  json stats() {
+    return {{"threads", threads()}, {"queued", queued()},
+            {"max_queued", max_queued}};
+  }
+};
+
+struct Executors {
+  Executor reads;
+  Executor writes;
+  Executor cpu;
+  // Password hashing is memory-hard, so it gets its own small pool: a login
+  // burst queues here (and sheds with 503s) instead of occupying httplib
+  // workers or the cpu pool that message traffic needs.
+  Executor hashing;
+  // Message shards after the first get a writer and a read pool of their
+  // own; shard 0 uses the two above.
+  std::vector<std::unique_ptr<Executor>> shard_reads;
+  std::vector<std::unique_ptr<Executor>> shard_writes;
+
+  Executors()
+      : reads("db-read", envOr("MAIL_DB_READERS", 4),
+              envOr("MAIL_DB_READ_QUEUE", 256)),
+        writes("db-write", 1, envOr("MAIL_DB_WRITE_QUEUE", 256)),
+        cpu("cpu",
+            envOr("MAIL_CPU_WORKERS",
+                  std::max(2u, std::thread::hardware_concurrency())),
+            envOr("MAIL_CPU_QUEUE", 256)),
+        hashing("hashing", hashWorkers(),
+                envOr("MAIL_HASH_QUEUE", 4 * hashWorkers())) {
+    for (size_t i = 1; i < dbShards(); i++) {
+      std::string suffix = "-" + std::to_string(i);
+      shard_reads.push_back(std::make_unique<Executor>(
+          "db-read" + suffix, reads.threads(),
+          envOr("MAIL_DB_READ_QUEUE", 256)));
+      shard_writes.push_back(std::make_unique<Executor>(
+          "db-write" + suffix, 1, envOr("MAIL_DB_WRITE_QUEUE", 256)));
+    }
+  }
+
+  static size_t hashWorkers() {
+    return envOr("MAIL_HASH_WORKERS",
+                 std::max(1u, std::thread::hardware_concurrency() / 2));
+  }
+
+  static size_t dbShards() {
+    return std::max<size_t>(1, envOr("MAIL_DB_SHARDS", 1));
+  }
+};
+
 struct Message {
 public:
   std::string from;
@@ -16,7 +228,8 @@ public:
 
   Message(std::string from, std::string to, std::string subject,
           std::string body, std::string id)
-      : from(from), to(to), subject(subject), body(body), id(id) {};
+      : from(std::move(from)), to(std::move(to)), subject(std::move(subject)),
+        body(std::move(body)), id(std::move(id)) {};
 };
 
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Message, from, to, subject, body, id);
@@ -32,579 +245,6600 @@ struct User {
   }
 };
 
-class Database {
+// Per-thread monotonic arena for request-scoped scratch: database rows, result
+// lists and response bodies under construction. A Scope frees everything at
+// once when the request ends, so the common case never reaches the global
+// heap; only requests that outgrow the inline block allocate upstream.
+class RequestArena {
+public:
+  class Scope {
+  public:
+    Scope() { state().depth++; }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    ~Scope() {
+      State &s = state();
+      if (--s.depth == 0) {
+        s.resource.release();
+        requests.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  // The resource may be handed to executor jobs the request waits on, but
+  // must not be used once the request's Scope has ended.
+  static std::pmr::memory_resource *resource() { return &state().resource; }
+
+  static json stats() {
+    return {{"inline_bytes", inlineBytes()},
+            {"requests", requests.load(std::memory_order_relaxed)},
+            {"overflow_allocations",
+             overflow_allocations.load(std::memory_order_relaxed)},
+            {"overflow_bytes", overflow_bytes.load(std::memory_order_relaxed)}};
+  }
+
 private:
-  sqlite3 *db;
+  class Upstream : public std::pmr::memory_resource {
+    void *do_allocate(size_t bytes, size_t align) override {
+      overflow_allocations.fetch_add(1, std::memory_order_relaxed);
+      overflow_bytes.fetch_add(bytes, std::memory_order_relaxed);
+      return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t align) override {
+      std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+    bool do_is_equal(const memory_resource &other) const noexcept override {
+      return this == &other;
+    }
+  };
+
+  struct State {
+    std::unique_ptr<std::byte[]> block{new std::byte[inlineBytes()]};
+    Upstream upstream;
+    std::pmr::monotonic_buffer_resource resource{block.get(), inlineBytes(),
+                                                 &upstream};
+    int depth = 0;
+  };
+
+  static size_t inlineBytes() {
+    static const size_t bytes = envOr("MAIL_REQUEST_ARENA_KB", 64) * 1024;
+    return bytes;
+  }
+
+  static State &state() {
+    thread_local State s;
+    return s;
+  }
+
+  static inline std::atomic<uint64_t> requests{0};
+  static inline std::atomic<uint64_t> overflow_allocations{0};
+  static inline std::atomic<uint64_t> overflow_bytes{0};
+};
+
+// A message read for a single request; its strings live in the allocator it
+// was built with, normally the request arena. Cached inboxes use MessageView.
+struct MessageRow {
+  using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+  std::pmr::string from;
+  std::pmr::string to;
+  std::pmr::string subject;
+  std::pmr::string body;
+  std::pmr::string id;
 
+  explicit MessageRow(allocator_type alloc = {})
+      : from(alloc), to(alloc), subject(alloc), body(alloc), id(alloc) {}
+  MessageRow(const MessageRow &other, allocator_type alloc)
+      : from(other.from, alloc), to(other.to, alloc),
+        subject(other.subject, alloc), body(other.body, alloc),
+        id(other.id, alloc) {}
+  MessageRow(MessageRow &&other, allocator_type alloc)
+      : from(std::move(other.from), alloc), to(std::move(other.to), alloc),
+        subject(std::move(other.subject), alloc),
+        body(std::move(other.body), alloc), id(std::move(other.id), alloc) {}
+};
+
+using MessageRows = std::pmr::vector<MessageRow>;
+
+void to_json(json &j, const MessageRow &m) {
+  j["from"] = std::string_view(m.from);
+  j["to"] = std::string_view(m.to);
+  j["subject"] = std::string_view(m.subject);
+  j["body"] = std::string_view(m.body);
+  j["id"] = std::string_view(m.id);
+}
+
+// Read-path form of a message: the fields are views into one immutable buffer
+// holding the row's text back to back, filled with a single copy straight
+// from the column data. Copies share the buffer, so copy-on-write inbox
+// updates never touch message bytes.
+class MessageView {
 public:
-  Database(const std::string &db_path) {
-    int rc = sqlite3_open(db_path.c_str(), &db);
-    if (rc) {
-      std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
-      throw std::runtime_error("Failed to open database");
+  std::string_view from;
+  std::string_view to;
+  std::string_view subject;
+  std::string_view body;
+  std::string_view id;
+
+  MessageView(std::string_view from, std::string_view to,
+              std::string_view subject, std::string_view body,
+              std::string_view id)
+      : MessageView(from, to, subject, body.size(), id, [body](char *out) {
+          std::memcpy(out, body.data(), body.size());
+        }) {}
+
+  // Lets the body be written in place, e.g. by sqlite3_blob_read, instead of
+  // passing through an intermediate copy.
+  template <typename Fill>
+  MessageView(std::string_view from, std::string_view to,
+              std::string_view subject, size_t body_size, std::string_view id,
+              Fill &&fill) {
+    size_t size =
+        from.size() + to.size() + subject.size() + body_size + id.size();
+    std::shared_ptr<char[]> data(new char[size]);
+    char *out = data.get();
+    auto place = [&out](std::string_view field) {
+      std::memcpy(out, field.data(), field.size());
+      std::string_view placed(out, field.size());
+      out += field.size();
+      return placed;
+    };
+    this->from = place(from);
+    this->to = place(to);
+    this->subject = place(subject);
+    fill(out);
+    this->body = std::string_view(out, body_size);
+    out += body_size;
+    this->id = place(id);
+    buffer = std::move(data);
+  }
+
+  // Views into storage kept alive by keeper, such as a mapped log segment;
+  // nothing is copied.
+  MessageView(std::string_view from, std::string_view to,
+              std::string_view subject, std::string_view body,
+              std::string_view id, std::shared_ptr<const char[]> keeper)
+      : from(from), to(to), subject(subject), body(body), id(id),
+        buffer(std::move(keeper)) {}
+
+  explicit MessageView(const Message &m)
+      : MessageView(m.from, m.to, m.subject, m.body, m.id) {}
+
+  size_t bytes() const {
+    return from.size() + to.size() + subject.size() + body.size() + id.size();
+  }
+
+private:
+  std::shared_ptr<const char[]> buffer;
+};
+
+// Same shape as the NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE output for Message.
+void to_json(json &j, const MessageView &m) {
+  j["from"] = m.from;
+  j["to"] = m.to;
+  j["subject"] = m.subject;
+  j["body"] = m.body;
+  j["id"] = m.id;
+}
+
+enum class WireFormat { Json = 0, Cbor = 1, MsgPack = 2 };
+
+constexpr size_t wire_format_count = 3;
+
+using Inbox = std::vector<MessageView>;
+
+std::string toHex(const unsigned char *data, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  out.reserve(size * 2);
+  for (size_t i = 0; i < size; i++) {
+    out += digits[data[i] >> 4];
+    out += digits[data[i] & 0xf];
+  }
+  return out;
+}
+
+bool writeAll(int out, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = ::write(out, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// 32 bytes from the OpenSSL CSPRNG as hex.
+std::string generateToken() {
+  unsigned char bytes[32];
+  if (RAND_bytes(bytes, sizeof bytes) != 1)
+    throw std::runtime_error("RAND_bytes failed");
+  return toHex(bytes, sizeof bytes);
+}
+
+// Fixed array of lock-free atomics in its own mapping. A shared array is a
+// MAP_SHARED mapping, so every worker forked after it is made sees the same
+// words.
+template <typename T> class AtomicArray {
+private:
+  static_assert(T::is_always_lock_free, "needs address-free atomics");
+  T *items;
+  size_t count;
+
+public:
+  AtomicArray(size_t count, bool shared) : count(count) {
+    void *mapped =
+        ::mmap(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE,
+               (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+      throw std::runtime_error("mmap failed");
+    items = static_cast<T *>(mapped);
+    for (size_t i = 0; i < count; i++)
+      new (&items[i]) T();
+  }
+
+  AtomicArray(const AtomicArray &) = delete;
+  AtomicArray &operator=(const AtomicArray &) = delete;
+
+  ~AtomicArray() { ::munmap(items, count * sizeof(T)); }
+
+  T &operator[](size_t i) const { return items[i]; }
+  size_t size() const { return count; }
+};
+
+// Inbox versions, hashed into a fixed table of counters (a collision only
+// costs a spurious miss), plus an epoch that moves every inbox on at once.
+// Versions restart with the server, so ETags carry a per-boot nonce to keep
+// a pre-restart tag from matching. With MAIL_WORKERS > 1 the table and the
+// nonce are made before forking, so a write in any worker invalidates
+// cached inboxes and ETags in all of them.
+class InboxVersions {
+private:
+  static constexpr size_t slots = 1 << 16;
+  AtomicArray<std::atomic<uint64_t>> counters;
+  const std::string boot = generateToken().substr(0, 8);
+
+  std::atomic<uint64_t> &counter(const std::string &username) const {
+    return counters[std::hash<std::string>{}(username) % slots];
+  }
+
+public:
+  explicit InboxVersions(bool shared) : counters(slots + 1, shared) {}
+
+  uint64_t get(const std::string &username) const {
+    return counter(username).load() + (counters[slots].load() << 32);
+  }
+
+  // Returns the new version.
+  uint64_t bump(const std::string &username) {
+    uint64_t count = ++counter(username);
+    return count + (counters[slots].load() << 32);
+  }
+
+  void bumpAll() { counters[slots]++; }
+
+  std::string etag(uint64_t version, WireFormat format) const {
+    std::stringstream ss;
+    ss << '"' << boot << '.' << std::hex << version << '.'
+       << static_cast<int>(format) << '"';
+    return ss.str();
+  }
+};
+
+// Byte-bounded cache of whole inboxes keyed by recipient, evicting with
+// S3-FIFO: new entries land in a small probationary FIFO and are only
+// promoted to the main FIFO if they are read again before falling out.
+// Keys evicted from the small queue are remembered in a ghost FIFO so an
+// inbox that comes straight back skips probation.
+//
+// Entries are immutable snapshots; writes replace them with an updated
+// copy. Every write also bumps the recipient's version, and put() refuses
+// a snapshot read under an older version so a slow miss can't overwrite a
+// newer write-through. Another worker's writes only move the version, so an
+// entry is also checked against it when read. The same version backs the
+// inbox ETag, and the last serialized response is kept next to the snapshot
+// it was built from.
+class InboxCache {
+public:
+  struct Snapshot {
+    std::shared_ptr<const Inbox> inbox;
+    std::shared_ptr<const std::string> body;
+    uint64_t version = 0;
+  };
+
+private:
+  struct Entry {
+    std::shared_ptr<const Inbox> inbox;
+    std::array<std::shared_ptr<const std::string>, wire_format_count> bodies;
+    uint64_t version = 0;
+    size_t bytes = 0;
+    uint8_t freq = 0;
+    bool in_main = false;
+    uint64_t generation = 0;
+  };
+
+  struct Slot {
+    std::string key;
+    uint64_t generation;
+  };
+
+  mutable std::mutex mtx;
+  InboxVersions &versions;
+  size_t capacity;
+  size_t small_capacity;
+  size_t small_bytes = 0;
+  size_t main_bytes = 0;
+  uint64_t next_generation = 0;
+  std::unordered_map<std::string, Entry> entries;
+  std::deque<Slot> small_queue;
+  std::deque<Slot> main_queue;
+  std::deque<std::string> ghost_queue;
+  std::unordered_map<std::string, size_t> ghosts;
+
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t ghost_hits = 0;
+  uint64_t stale_puts = 0;
+  uint64_t stale_entries = 0;
+
+  static size_t inboxBytes(const std::string &key, const Inbox &inbox) {
+    size_t bytes = sizeof(Entry) + key.capacity() + sizeof(Inbox) +
+                   inbox.capacity() * sizeof(MessageView);
+    for (const auto &m : inbox)
+      bytes += m.bytes();
+    return bytes;
+  }
+
+  bool live(const Slot &slot, bool main) const {
+    auto it = entries.find(slot.key);
+    return it != entries.end() && it->second.generation == slot.generation &&
+           it->second.in_main == main;
+  }
+
+  void drop(std::unordered_map<std::string, Entry>::iterator it) {
+    (it->second.in_main ? main_bytes : small_bytes) -= it->second.bytes;
+    entries.erase(it);
+  }
+
+  void rememberGhost(const std::string &key) {
+    ghost_queue.push_back(key);
+    ghosts[key]++;
+    size_t limit = std::max<size_t>(64, entries.size());
+    while (ghost_queue.size() > limit) {
+      auto it = ghosts.find(ghost_queue.front());
+      if (it != ghosts.end() && --it->second == 0)
+        ghosts.erase(it);
+      ghost_queue.pop_front();
     }
-    initTables();
   }
 
-  ~Database() { sqlite3_close(db); }
+  void evictSmall() {
+    while (!small_queue.empty()) {
+      Slot slot = small_queue.front();
+      small_queue.pop_front();
+      if (!live(slot, false))
+        continue;
+      auto it = entries.find(slot.key);
+      if (it->second.freq > 0) {
+        it->second.freq = 0;
+        it->second.in_main = true;
+        small_bytes -= it->second.bytes;
+        main_bytes += it->second.bytes;
+        main_queue.push_back(slot);
+      } else {
+        rememberGhost(slot.key);
+        drop(it);
+        evictions++;
+      }
+      return;
+    }
+  }
 
-  void initTables() {
-    const char *sql = R"(
-	create table if not exists users (
-	id integer primary key autoincrement,
-	username text unique not null,
-	password text not null
-	);
+  void evictMain() {
+    while (!main_queue.empty()) {
+      Slot slot = main_queue.front();
+      main_queue.pop_front();
+      if (!live(slot, true))
+        continue;
+      auto it = entries.find(slot.key);
+      if (it->second.freq > 0) {
+        it->second.freq--;
+        main_queue.push_back(slot);
+        continue;
+      }
+      drop(it);
+      evictions++;
+      return;
+    }
+  }
 
-	create table if not exists messages (
-	  id text primary key,
-	  from_user text not null,
-	  to_user text not null,
-	  subject text not null,
-	  body text not null,
-	  created_at timestamp default current_timestamp
-	  );
+  void makeRoom(size_t incoming) {
+    while (small_bytes + main_bytes + incoming > capacity &&
+           !entries.empty()) {
+      if (small_bytes > small_capacity || main_queue.empty())
+        evictSmall();
+      else
+        evictMain();
+    }
+  }
 
-	  create index if not exists idx_messages_to on messages(to_user);
-	  create index if not exists idx_messages_from on messages(from_user);
-      )";
+  void store(const std::string &key, std::shared_ptr<const Inbox> inbox,
+             uint64_t version, bool into_main) {
+    size_t bytes = inboxBytes(key, *inbox);
+    if (bytes > capacity)
+      return;
+    makeRoom(bytes);
+    Entry &entry = entries[key];
+    entry.inbox = std::move(inbox);
+    entry.bodies = {};
+    entry.version = version;
+    entry.bytes = bytes;
+    entry.in_main = into_main;
+    entry.generation = ++next_generation;
+    (into_main ? main_bytes : small_bytes) += bytes;
+    (into_main ? main_queue : small_queue)
+        .push_back({key, entry.generation});
+  }
 
-    char *errMsg;
-    int rc = sqlite3_exec(db, sql, nullptr, nullptr, &errMsg);
-    if (rc != SQLITE_OK) {
-      std::cerr << "SQL error: " << errMsg << std::endl;
-      sqlite3_free(errMsg);
+  // Swaps in an updated copy of a cached inbox, keeping its queue position.
+  // An entry that isn't at version before has missed another worker's write
+  // and is dropped instead.
+  template <typename F>
+  void update(const std::string &key, uint64_t before, uint64_t after,
+              F &&change) {
+    auto it = entries.find(key);
+    if (it == entries.end())
+      return;
+    if (it->second.version != before) {
+      drop(it);
+      return;
+    }
+    auto inbox = std::make_shared<Inbox>(*it->second.inbox);
+    change(*inbox);
+    it->second.bodies = {};
+    it->second.version = after;
+    size_t bytes = inboxBytes(key, *inbox);
+    (it->second.in_main ? main_bytes : small_bytes) += bytes;
+    (it->second.in_main ? main_bytes : small_bytes) -= it->second.bytes;
+    it->second.bytes = bytes;
+    it->second.inbox = std::move(inbox);
+    makeRoom(0);
+  }
+
+public:
+  InboxCache(size_t capacity_bytes, InboxVersions &versions)
+      : versions(versions), capacity(capacity_bytes),
+        small_capacity(capacity_bytes / 10) {}
+
+  // Version token for a later put(); read it before querying the database.
+  uint64_t version(const std::string &username) const {
+    return versions.get(username);
+  }
+
+  std::string etag(uint64_t version, WireFormat format) const {
+    return versions.etag(version, format);
+  }
+
+  // On a miss only the version is filled in; pass it to put() along with
+  // what was read from the database.
+  Snapshot get(const std::string &username, WireFormat format) {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t current = versions.get(username);
+    auto it = entries.find(username);
+    if (it != entries.end() && it->second.version != current) {
+      drop(it);
+      stale_entries++;
+      it = entries.end();
+    }
+    if (it == entries.end()) {
+      misses++;
+      return {nullptr, nullptr, current};
+    }
+    hits++;
+    if (it->second.freq < 3)
+      it->second.freq++;
+    return {it->second.inbox,
+            it->second.bodies[static_cast<size_t>(format)],
+            it->second.version};
+  }
+
+  void put(const std::string &username, std::shared_ptr<const Inbox> inbox,
+           uint64_t read_version) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (versions.get(username) != read_version) {
+      stale_puts++;
+      return;
+    }
+    if (entries.count(username) > 0)
+      return;
+    bool ghost = ghosts.count(username) > 0;
+    if (ghost)
+      ghost_hits++;
+    store(username, std::move(inbox), read_version, ghost);
+  }
+
+  void putBody(const std::string &username, uint64_t version,
+               WireFormat format, std::shared_ptr<const std::string> body) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = entries.find(username);
+    if (it == entries.end() || it->second.version != version)
+      return;
+    auto &slot = it->second.bodies[static_cast<size_t>(format)];
+    if (slot)
+      return;
+    size_t bytes = body->capacity();
+    (it->second.in_main ? main_bytes : small_bytes) += bytes;
+    it->second.bytes += bytes;
+    slot = std::move(body);
+    makeRoom(0);
+  }
+
+  void messageCreated(const Message &msg) {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t version = versions.bump(msg.to);
+    update(msg.to, version - 1, version, [&msg](Inbox &inbox) {
+      for (const auto &m : inbox)
+        if (m.id == msg.id)
+          return;
+      inbox.insert(inbox.begin(), MessageView(msg));
+    });
+  }
+
+  void messageDeleted(const std::string &username, const std::string &id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t version = versions.bump(username);
+    update(username, version - 1, version, [&id](Inbox &inbox) {
+      inbox.erase(std::remove_if(inbox.begin(), inbox.end(),
+                                 [&id](const MessageView &m) { return m.id == id; }),
+                  inbox.end());
+    });
+  }
+
+  // deleteUser also removes everything the user sent, which can touch any
+  // inbox, so this moves the epoch on to fail any read that was in flight.
+  // Entries that were current carry over to the new epoch with the user's
+  // messages stripped; ones another worker has written to since are dropped.
+  void userDeleted(const std::string &username) {
+    std::lock_guard<std::mutex> lock(mtx);
+    versions.bumpAll();
+    auto it = entries.find(username);
+    if (it != entries.end())
+      drop(it);
+
+    const uint64_t epoch_step = uint64_t(1) << 32;
+    std::vector<std::string> stale;
+    std::vector<std::string> affected;
+    for (auto &[key, entry] : entries) {
+      if (versions.get(key) != entry.version + epoch_step) {
+        stale.push_back(key);
+        continue;
+      }
+      bool sent = std::any_of(
+          entry.inbox->begin(), entry.inbox->end(),
+          [&username](const MessageView &m) { return m.from == username; });
+      if (sent)
+        affected.push_back(key);
+      else
+        entry.version += epoch_step;
+    }
+    for (const auto &key : stale)
+      drop(entries.find(key));
+    for (const auto &key : affected) {
+      auto found = entries.find(key);
+      if (found == entries.end())
+        continue;
+      uint64_t before = found->second.version;
+      update(key, before, before + epoch_step, [&username](Inbox &inbox) {
+        inbox.erase(std::remove_if(inbox.begin(), inbox.end(),
+                                   [&username](const MessageView &m) {
+                                     return m.from == username;
+                                   }),
+                    inbox.end());
+      });
+    }
+  }
+
+  json stats() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t lookups = hits + misses;
+    return {{"entries", entries.size()},
+            {"bytes", small_bytes + main_bytes},
+            {"capacity", capacity},
+            {"small_bytes", small_bytes},
+            {"main_bytes", main_bytes},
+            {"hits", hits},
+            {"misses", misses},
+            {"hit_ratio", lookups == 0 ? 0.0 : double(hits) / lookups},
+            {"evictions", evictions},
+            {"ghost_hits", ghost_hits},
+            {"stale_puts", stale_puts},
+            {"stale_entries", stale_entries}};
+  }
+};
+
+// Storage behind the handlers. MAIL_DB_ENGINE picks the implementation:
+// "sqlite" (the default) or "log", an append-only log with an in-memory
+// index. Message shards all use the same engine.
+class Database {
+public:
+  enum class Engine { Sqlite, Log };
+
+  // The rebalancer moves whole inboxes: read one out with bodies decoded and
+  // timestamps kept, write it to its new shard, then delete the original.
+  struct StoredMessage {
+    Message msg;
+    std::string created_at;
+  };
+
+  virtual ~Database() = default;
+
+  static Engine engine() {
+    const char *name = std::getenv("MAIL_DB_ENGINE");
+    return name && std::string_view(name) == "log" ? Engine::Log
+                                                   : Engine::Sqlite;
+  }
+
+  virtual bool createUser(const std::string &username,
+                          const std::string &password) = 0;
+  // The stored credential: a PasswordHasher string, or the plaintext
+  // password for rows created before hashing.
+  virtual std::optional<std::string>
+  getPassword(const std::string &username) = 0;
+  virtual bool setPassword(const std::string &username,
+                           const std::string &password) = 0;
+  virtual bool userExists(const std::string &username) = 0;
+  virtual std::pmr::vector<std::pmr::string>
+  getUsers(std::pmr::memory_resource *mr) = 0;
+
+  virtual bool createMessage(const Message &msg) = 0;
+  // Newest first.
+  virtual Inbox getMessagesForUser(const std::string &username) = 0;
+  virtual MessageRows searchMessages(const std::string &username,
+                                     const std::string &query, int limit,
+                                     int offset,
+                                     std::pmr::memory_resource *mr) = 0;
+  virtual bool deleteMessage(const std::string &username,
+                             const std::string &msg_id) = 0;
+  // Also removes everything the user sent.
+  virtual bool deleteUser(const std::string &username) = 0;
+  // Clears the user's messages, sent and received, from a shard that doesn't
+  // hold the users table.
+  virtual void deleteMessagesOf(const std::string &username) = 0;
+  virtual json bodyStats() = 0;
+
+  virtual std::vector<std::string> recipients() = 0;
+  // Oldest first, so importing keeps the inbox order.
+  virtual std::optional<std::vector<StoredMessage>>
+  exportInbox(const std::string &username) = 0;
+  // Ids already present are skipped, so an interrupted move can be rerun.
+  virtual bool importMessages(const std::vector<StoredMessage> &messages) = 0;
+  virtual bool deleteInbox(const std::string &username) = 0;
+
+  // Background upkeep that should stay out of the way of requests, run only
+  // while idle() holds. Engines that need none ignore it.
+  virtual void startMaintenance(std::function<bool()> /*idle*/) {}
+  // Takes WAL checkpoints off the request path. Unlike maintenance, every
+  // process that writes runs its own.
+  virtual void startCheckpoints() {}
+  virtual json maintenanceStats() { return json::object(); }
+
+  // Writes a consistent copy of the database to path while it stays in
+  // use, pages_per_step pages at a time. step(bytes_done, bytes_total) runs
+  // between steps to pace the copy and returns false to abandon it. Engines
+  // that can't return false.
+  virtual bool backup(const std::string &, int,
+                      const std::function<bool(int64_t, int64_t)> &) {
+    return false;
+  }
+};
+
+class SqliteDatabase : public Database {
+private:
+  std::string db_path;
+  sqlite3 *db;
+  std::mutex write_mtx;
+
+  // Read-only connections so readers on the db-read executor don't serialize
+  // on the writer's handle. WAL mode lets them run alongside the writer.
+  std::vector<sqlite3 *> readers;
+  std::vector<sqlite3 *> idle_readers;
+  std::mutex readers_mtx;
+  std::condition_variable readers_cv;
+
+  class ReadConnection {
+  private:
+    SqliteDatabase &owner;
+    sqlite3 *conn;
+
+  public:
+    explicit ReadConnection(SqliteDatabase &owner) : owner(owner) {
+      std::unique_lock<std::mutex> lock(owner.readers_mtx);
+      owner.readers_cv.wait(lock,
+                            [&owner] { return !owner.idle_readers.empty(); });
+      conn = owner.idle_readers.back();
+      owner.idle_readers.pop_back();
+    }
+
+    ~ReadConnection() {
+      {
+        std::lock_guard<std::mutex> lock(owner.readers_mtx);
+        owner.idle_readers.push_back(conn);
+      }
+      owner.readers_cv.notify_one();
+    }
+
+    operator sqlite3 *() const { return conn; }
+  };
+
+  // Bodies above this size are written and read with incremental blob I/O
+  // rather than passing through a bound parameter or result column.
+  const size_t stream_threshold = envOr("MAIL_BODY_STREAM_BYTES", 16 * 1024);
+
+  // Bodies of at least compress_threshold bytes are stored deflated against
+  // the current preset dictionary when that makes them smaller. Every stored
+  // body records its codec and dictionary version, and is only inflated when
+  // it is actually returned.
+  enum class BodyCodec { Raw = 0, Deflate = 1 };
+
+  struct PackedBody {
+    BodyCodec codec = BodyCodec::Raw;
+    sqlite3_int64 dict_id = 0;
+    std::string deflated;
+  };
+
+  const size_t compress_threshold = envOr("MAIL_BODY_COMPRESS_BYTES", 256);
+  const int compress_level =
+      std::clamp<int>(envOr("MAIL_BODY_COMPRESS_LEVEL", 6), 1, 9);
+  const size_t dict_retrain = envOr("MAIL_BODY_DICT_RETRAIN", 1000);
+  static constexpr size_t dict_samples = 512;
+  static constexpr size_t dict_max_bytes = 32 * 1024;
+
+  // Dictionaries are immutable once stored; old versions stay loaded so rows
+  // written with them can still be read.
+  mutable std::map<sqlite3_int64, std::shared_ptr<const std::string>>
+      dictionaries;
+  mutable std::shared_mutex dict_mtx;
+  std::atomic<sqlite3_int64> current_dict{0};
+
+  // Deletes leave free pages behind. With auto_vacuum=incremental a
+  // maintenance thread hands them back to the filesystem a few at a time,
+  // and refreshes planner statistics, whenever the shard has been idle for
+  // a tick. Each step holds write_mtx for at most one incremental_vacuum
+  // call, so a write arriving mid-slice waits for one step, not the slice.
+  struct Maintenance {
+    uint64_t ticks = 0;
+    uint64_t deferred = 0;
+    uint64_t vacuum_steps = 0;
+    uint64_t reclaimed_pages = 0;
+    int64_t total_step_us = 0;
+    int64_t max_step_us = 0;
+    uint64_t analyze_runs = 0;
+    int64_t last_analyze_us = 0;
+    uint64_t trainings = 0;
+    int64_t last_training_us = 0;
+  };
+
+  const size_t vacuum_pages = envOr("MAIL_DB_VACUUM_PAGES", 128);
+  const size_t vacuum_min_pages = envOr("MAIL_DB_VACUUM_MIN_PAGES", 64);
+  std::function<bool()> idle;
+  std::thread maintainer;
+  std::mutex maintenance_mtx;
+  std::condition_variable maintenance_cv;
+  bool stopping = false;
+  Maintenance maintenance;
+
+  // SQLite's own checkpoint runs inside whichever commit crosses
+  // wal_autocheckpoint, so one request pays for copying the whole WAL back.
+  // Instead a checkpointer thread, on a connection of its own so it never
+  // holds write_mtx, runs a PASSIVE checkpoint once MAIL_DB_CHECKPOINT_PAGES
+  // frames are waiting. A WAL that has grown to
+  // MAIL_DB_CHECKPOINT_RESTART_PAGES (because readers kept it pinned) gets a
+  // RESTART instead, but only while no read connection is in use: RESTART
+  // holds off writers while it waits for readers, for at most
+  // MAIL_DB_CHECKPOINT_WAIT_MS.
+  struct Checkpoints {
+    uint64_t passive = 0;
+    uint64_t restarts = 0;
+    uint64_t busy = 0;
+    uint64_t restarts_deferred = 0;
+    uint64_t frames = 0;
+    int64_t total_us = 0;
+    int64_t max_us = 0;
+    int64_t last_us = 0;
+  };
+
+  const int checkpoint_pages =
+      std::max<int>(envOr("MAIL_DB_CHECKPOINT_PAGES", 1000), 1);
+  const int restart_pages =
+      std::max<int>(envOr("MAIL_DB_CHECKPOINT_RESTART_PAGES", 4000), 1);
+  sqlite3 *checkpoint_db = nullptr;
+  std::thread checkpointer;
+  std::condition_variable checkpoint_cv;
+  // Frames in the WAL as of the last commit, and how many of those the last
+  // checkpoint copied back.
+  std::atomic<int> wal_frames{0};
+  std::atomic<int> backfilled{0};
+  std::atomic<bool> checkpoint_wanted{false};
+  Checkpoints checkpoints;
+  // Backups in progress; each holds a read snapshot open, so it counts as
+  // an active reader.
+  std::atomic<int> snapshots{0};
+  z_stream deflater{};
+  bool deflater_ready = false;
+
+  // A miss means another worker process trained the version after this one
+  // loaded the table, so it is read from the database on a connection of
+  // its own; the caller may be inside a statement on any of ours.
+  std::shared_ptr<const std::string> dictionary(sqlite3_int64 id) const {
+    {
+      std::shared_lock<std::shared_mutex> lock(dict_mtx);
+      auto it = dictionaries.find(id);
+      if (it != dictionaries.end())
+        return it->second;
+    }
+    if (id <= 0)
+      return nullptr;
+
+    std::shared_ptr<const std::string> dict;
+    sqlite3 *conn;
+    sqlite3_stmt *stmt;
+    if (sqlite3_open_v2(db_path.c_str(), &conn, SQLITE_OPEN_READONLY,
+                        nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(conn,
+                           "select dictionary from body_dictionaries "
+                           "where id = ?",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+      sqlite3_busy_timeout(conn, 5000);
+      sqlite3_bind_int64(stmt, 1, id);
+      if (sqlite3_step(stmt) == SQLITE_ROW) {
+        auto data = static_cast<const char *>(sqlite3_column_blob(stmt, 0));
+        dict = std::make_shared<const std::string>(
+            data ? data : "", sqlite3_column_bytes(stmt, 0));
+      }
+      sqlite3_finalize(stmt);
     }
+    sqlite3_close(conn);
+    if (!dict)
+      return nullptr;
+    std::unique_lock<std::shared_mutex> lock(dict_mtx);
+    return dictionaries.emplace(id, std::move(dict)).first->second;
   }
 
-  bool createUser(const std::string &username, const std::string &password) {
+  // Called inside the write transaction. Other workers may have trained a
+  // newer version and will drop older ones nothing refers to, so each body
+  // is packed with the newest, which can't go away before the commit.
+  sqlite3_int64 newestDictionary() {
     sqlite3_stmt *stmt;
-    const char *sql = "INSERT INTO users (username, password) VALUES (?, ?)";
+    if (sqlite3_prepare_v2(db, "select max(id) from body_dictionaries", -1,
+                           &stmt, nullptr) != SQLITE_OK)
+      return current_dict.load();
+    sqlite3_int64 id = sqlite3_step(stmt) == SQLITE_ROW
+                           ? sqlite3_column_int64(stmt, 0)
+                           : current_dict.load();
+    sqlite3_finalize(stmt);
+    current_dict = id;
+    return id;
+  }
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-      return false;
+  // Called with write_mtx held; the deflate stream is reused across bodies.
+  PackedBody packBody(std::string_view body) {
+    PackedBody packed;
+    if (compress_threshold == 0 || body.size() < compress_threshold)
+      return packed;
+
+    if (!deflater_ready) {
+      if (deflateInit2(&deflater, compress_level, Z_DEFLATED, -15, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK)
+        return packed;
+      deflater_ready = true;
+    } else {
+      deflateReset(&deflater);
     }
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, password.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_int64 dict_id = newestDictionary();
+    auto dict = dictionary(dict_id);
+    if (dict)
+      deflateSetDictionary(&deflater,
+                           reinterpret_cast<const Bytef *>(dict->data()),
+                           dict->size());
+
+    std::string out(deflateBound(&deflater, body.size()), '\0');
+    deflater.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+    deflater.avail_in = body.size();
+    deflater.next_out = reinterpret_cast<Bytef *>(out.data());
+    deflater.avail_out = out.size();
+    if (deflate(&deflater, Z_FINISH) != Z_STREAM_END ||
+        deflater.total_out >= body.size())
+      return packed;
+
+    out.resize(deflater.total_out);
+    packed.codec = BodyCodec::Deflate;
+    packed.dict_id = dict ? dict_id : 0;
+    packed.deflated = std::move(out);
+    return packed;
+  }
+
+  // Decodes a stored body into exactly size bytes at out.
+  bool unpackBody(int codec, sqlite3_int64 dict_id, const void *data,
+                  size_t data_size, char *out, size_t size) const {
+    if (codec == static_cast<int>(BodyCodec::Raw)) {
+      if (data_size != size)
+        return false;
+      std::memcpy(out, data, size);
+      return true;
+    }
+    if (codec != static_cast<int>(BodyCodec::Deflate))
+      return false;
+
+    // Each reader thread keeps one inflate stream; setting it up costs more
+    // than inflating a typical body.
+    struct Inflater {
+      z_stream zs{};
+      bool ready = inflateInit2(&zs, -15) == Z_OK;
+      ~Inflater() {
+        if (ready)
+          inflateEnd(&zs);
+      }
+    };
+    thread_local Inflater inflater;
+    z_stream &zs = inflater.zs;
+    if (!inflater.ready || inflateReset(&zs) != Z_OK)
+      return false;
+
+    bool ok = true;
+    if (dict_id != 0) {
+      auto dict = dictionary(dict_id);
+      ok = dict && inflateSetDictionary(
+                       &zs, reinterpret_cast<const Bytef *>(dict->data()),
+                       dict->size()) == Z_OK;
+    }
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(data));
+    zs.avail_in = data_size;
+    zs.next_out = reinterpret_cast<Bytef *>(out);
+    zs.avail_out = size;
+    return ok && inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == size;
+  }
+
+  void registerFunctions(sqlite3 *conn) {
+    sqlite3_create_function(conn, "content_hash", 1,
+                            SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr,
+                            sqlContentHash, nullptr, nullptr);
+  }
+
+  // Builds a deflate preset dictionary from sample bodies. Samples are cut
+  // into 64-byte segments scored by how many other samples share their 8-byte
+  // grams; segments are picked greedily, with grams already covered no longer
+  // counting, and the best ones go last since deflate favours near matches.
+  static std::string buildDictionary(const std::vector<std::string> &samples,
+                                     size_t max_size) {
+    constexpr size_t gram = 8;
+    constexpr size_t segment = 64;
+    auto gramAt = [](const char *p) {
+      uint64_t g;
+      std::memcpy(&g, p, gram);
+      return g;
+    };
+
+    // Grams are counted in one sorted array rather than a table entry per
+    // distinct gram; on large samples most grams are unique, and only the
+    // shared ones are worth keeping.
+    std::vector<uint64_t> grams;
+    for (const auto &sample : samples) {
+      size_t first = grams.size();
+      for (size_t i = 0; i + gram <= sample.size(); i++)
+        grams.push_back(gramAt(sample.data() + i));
+      std::sort(grams.begin() + first, grams.end());
+      grams.erase(std::unique(grams.begin() + first, grams.end()),
+                  grams.end());
+    }
+    std::sort(grams.begin(), grams.end());
+
+    std::unordered_map<uint64_t, uint32_t> shared;
+    for (size_t i = 0; i < grams.size();) {
+      size_t j = i;
+      while (j < grams.size() && grams[j] == grams[i])
+        j++;
+      if (j - i > 1)
+        shared.emplace(grams[i], j - i);
+      i = j;
+    }
+    grams = {};
+
+    auto score = [&](std::string_view text) {
+      uint64_t total = 0;
+      for (size_t i = 0; i + gram <= text.size(); i++) {
+        auto it = shared.find(gramAt(text.data() + i));
+        if (it != shared.end())
+          total += it->second - 1;
+      }
+      return total;
+    };
+
+    using Candidate = std::pair<uint64_t, std::string_view>;
+    std::priority_queue<Candidate> candidates;
+    for (const auto &sample : samples)
+      for (size_t start = 0; start < sample.size(); start += segment) {
+        std::string_view text(sample.data() + start,
+                              std::min(segment, sample.size() - start));
+        if (uint64_t s = score(text))
+          candidates.push({s, text});
+      }
+
+    std::vector<std::string_view> chosen;
+    size_t total = 0;
+    while (!candidates.empty() && total < max_size) {
+      auto [old_score, text] = candidates.top();
+      candidates.pop();
+      uint64_t current = score(text);
+      if (current == 0)
+        continue;
+      if (current < old_score && !candidates.empty() &&
+          current < candidates.top().first) {
+        candidates.push({current, text});
+        continue;
+      }
+      if (total + text.size() > max_size)
+        continue;
+      chosen.push_back(text);
+      total += text.size();
+      for (size_t i = 0; i + gram <= text.size(); i++)
+        shared.erase(gramAt(text.data() + i));
+    }
+
+    std::string dict;
+    dict.reserve(total);
+    for (auto it = chosen.rbegin(); it != chosen.rend(); ++it)
+      dict.append(*it);
+    return dict;
+  }
+
+  void loadDictionaries() {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+                           "select id, dictionary from body_dictionaries "
+                           "order by id",
+                           -1, &stmt, nullptr) != SQLITE_OK)
+      return;
+    std::unique_lock<std::shared_mutex> lock(dict_mtx);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+      auto data = static_cast<const char *>(sqlite3_column_blob(stmt, 1));
+      dictionaries[id] = std::make_shared<const std::string>(
+          data ? data : "", sqlite3_column_bytes(stmt, 1));
+      current_dict = id;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  // Trains a new dictionary version from the most recent bodies. Versions no
+  // row refers to any more are dropped from the table but stay loaded, in
+  // case a reader is still decoding a row it fetched earlier. Runs on the
+  // maintenance thread: samples and unreferenced versions are found on a
+  // read connection and the dictionary built without locks, so write_mtx is
+  // only held to store the new version and make it current.
+  //
+  // Writers only ever pack with the newest version, so one older than that
+  // with no rows in this snapshot can't gain any before it is dropped.
+  void trainDictionary() {
+    std::vector<std::string> samples;
+    std::vector<sqlite3_int64> unused;
+    sqlite3_stmt *stmt;
+    {
+      ReadConnection conn(*this);
+      if (sqlite3_prepare_v2(conn,
+                             "select body, codec, dict_id, size from "
+                             "message_bodies order by id desc limit ?",
+                             -1, &stmt, nullptr) != SQLITE_OK)
+        return;
+      sqlite3_bind_int64(stmt, 1, dict_samples);
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        std::string body(sqlite3_column_int64(stmt, 3), '\0');
+        if (unpackBody(sqlite3_column_int(stmt, 1),
+                       sqlite3_column_int64(stmt, 2),
+                       sqlite3_column_blob(stmt, 0),
+                       sqlite3_column_bytes(stmt, 0), body.data(),
+                       body.size()))
+          samples.push_back(std::move(body));
+      }
+      sqlite3_finalize(stmt);
+
+      if (sqlite3_prepare_v2(conn,
+                             "select id from body_dictionaries where id < "
+                             "(select max(id) from body_dictionaries) and "
+                             "id not in (select dict_id from message_bodies "
+                             "where dict_id is not null)",
+                             -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+          unused.push_back(sqlite3_column_int64(stmt, 0));
+        sqlite3_finalize(stmt);
+      }
+    }
+
+    std::string dict = buildDictionary(samples, dict_max_bytes);
+    if (dict.size() < 256)
+      return;
+
+    std::lock_guard<std::mutex> lock(write_mtx);
+    if (sqlite3_prepare_v2(db,
+                           "insert into body_dictionaries (dictionary) "
+                           "values (?)",
+                           -1, &stmt, nullptr) != SQLITE_OK)
+      return;
+    sqlite3_bind_blob64(stmt, 1, dict.data(), dict.size(), SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+      return;
+
+    sqlite3_int64 id = sqlite3_last_insert_rowid(db);
+    {
+      std::unique_lock<std::shared_mutex> lock(dict_mtx);
+      dictionaries[id] = std::make_shared<const std::string>(std::move(dict));
+    }
+    current_dict = id;
+
+    if (unused.empty() ||
+        sqlite3_prepare_v2(db, "delete from body_dictionaries where id = ?",
+                           -1, &stmt, nullptr) != SQLITE_OK)
+      return;
+    for (sqlite3_int64 old : unused) {
+      sqlite3_bind_int64(stmt, 1, old);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  // Hashes eight bytes per step with a multiply-xorshift mix. Dedup lookups
+  // confirm a hit by comparing the bytes, so this only has to spread well.
+  static uint64_t contentHash(std::string_view data) {
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t hash = data.size() * k;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+      uint64_t word;
+      std::memcpy(&word, data.data() + i, 8);
+      hash = (hash ^ word) * k;
+      hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data.data() + i, data.size() - i);
+    hash = (hash ^ tail) * k;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+  static void sqlContentHash(sqlite3_context *ctx, int, sqlite3_value **argv) {
+    auto data = static_cast<const char *>(sqlite3_value_blob(argv[0]));
+    size_t size = sqlite3_value_bytes(argv[0]);
+    sqlite3_result_int64(ctx, contentHash({data ? data : "", size}));
+  }
+
+  // Identical bodies are stored once: a hash hit whose decoded bytes also
+  // match takes another reference instead of writing the content again.
+  std::optional<sqlite3_int64> storeBody(std::string_view body) {
+    auto hash = static_cast<sqlite3_int64>(contentHash(body));
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+                           "select id, body, codec, dict_id from "
+                           "message_bodies where hash = ? and size = ?",
+                           -1, &stmt, nullptr) != SQLITE_OK)
+      return std::nullopt;
+    sqlite3_bind_int64(stmt, 1, hash);
+    sqlite3_bind_int64(stmt, 2, body.size());
+    std::optional<sqlite3_int64> existing;
+    std::string candidate(body.size(), '\0');
+    while (!existing && sqlite3_step(stmt) == SQLITE_ROW) {
+      if (unpackBody(sqlite3_column_int(stmt, 2), sqlite3_column_int64(stmt, 3),
+                     sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1),
+                     candidate.data(), candidate.size()) &&
+          candidate == body)
+        existing = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    if (existing) {
+      if (sqlite3_prepare_v2(db,
+                             "update message_bodies set refs = refs + 1 "
+                             "where id = ?",
+                             -1, &stmt, nullptr) != SQLITE_OK)
+        return std::nullopt;
+      sqlite3_bind_int64(stmt, 1, *existing);
+      int rc = sqlite3_step(stmt);
+      sqlite3_finalize(stmt);
+      if (rc != SQLITE_DONE)
+        return std::nullopt;
+      return existing;
+    }
+
+    return insertBody(body, hash);
+  }
+
+  // Large bodies are inserted as a zeroblob and filled with sqlite3_blob_write
+  // so SQLite never assembles a second full-size copy of the record.
+  std::optional<sqlite3_int64> insertBody(std::string_view body,
+                                          sqlite3_int64 hash) {
+    PackedBody packed = packBody(body);
+    std::string_view stored =
+        packed.codec == BodyCodec::Raw ? body : packed.deflated;
+    bool stream = stored.size() > stream_threshold;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+                           "insert into message_bodies (body, hash, size, "
+                           "codec, dict_id) values (?, ?, ?, ?, ?)",
+                           -1, &stmt, nullptr) != SQLITE_OK)
+      return std::nullopt;
+
+    if (stream)
+      sqlite3_bind_zeroblob64(stmt, 1, stored.size());
+    else
+      sqlite3_bind_blob64(stmt, 1, stored.data(), stored.size(),
+                          SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, hash);
+    sqlite3_bind_int64(stmt, 3, body.size());
+    sqlite3_bind_int(stmt, 4, static_cast<int>(packed.codec));
+    if (packed.dict_id != 0)
+      sqlite3_bind_int64(stmt, 5, packed.dict_id);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+      return std::nullopt;
+
+    sqlite3_int64 id = sqlite3_last_insert_rowid(db);
+    if (!stream)
+      return id;
+
+    sqlite3_blob *blob;
+    rc = sqlite3_blob_open(db, "main", "message_bodies", "body", id, 1, &blob);
+    if (rc == SQLITE_OK)
+      rc = sqlite3_blob_write(blob, stored.data(), stored.size(), 0);
+    sqlite3_blob_close(blob);
+    if (rc != SQLITE_OK)
+      return std::nullopt;
+    return id;
+  }
+
+  // Called inside a write transaction. An empty created_at means now; the
+  // rebalancer passes the original through so moved inboxes keep their order.
+  bool insertMessage(const Message &msg, const std::string &created_at) {
+    auto body_id = storeBody(msg.body);
+    sqlite3_stmt *stmt;
+    const char *sql =
+        "insert into messages (id, from_user, to_user, subject, body_id, "
+        "body_size, created_at) "
+        "values (?, ?, ?, ?, ?, ?, coalesce(?, current_timestamp))";
+    if (!body_id ||
+        sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+      return false;
+
+    sqlite3_bind_text(stmt, 1, msg.id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, msg.from.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, msg.to.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 4, msg.subject.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 5, *body_id);
+    sqlite3_bind_int64(stmt, 6, msg.body.size());
+    if (!created_at.empty())
+      sqlite3_bind_text(stmt, 7, created_at.c_str(), -1, SQLITE_TRANSIENT);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE &&
+           indexMessage(sqlite3_last_insert_rowid(db), msg.subject, msg.body);
+  }
+
+  // The search index keeps its own copy of the text, so it is written here
+  // with the plaintext in hand and removed by rowid in the delete trigger;
+  // nothing in the schema needs to decode a stored body.
+  bool indexMessage(sqlite3_int64 rowid, std::string_view subject,
+                    std::string_view body) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+                           "insert into messages_fts(rowid, subject, body) "
+                           "values (?, ?, ?)",
+                           -1, &stmt, nullptr) != SQLITE_OK)
+      return false;
+    sqlite3_bind_int64(stmt, 1, rowid);
+    sqlite3_bind_text64(stmt, 2, subject.data(), subject.size(), SQLITE_STATIC,
+                        SQLITE_UTF8);
+    sqlite3_bind_text64(stmt, 3, body.data(), body.size(), SQLITE_STATIC,
+                        SQLITE_UTF8);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE;
+  }
+
+  // Refills the search index from messages inside a write transaction. A
+  // body that can't be decoded is left out of the index and reported.
+  bool reindexSearch() {
+    if (sqlite3_exec(db, "delete from messages_fts", nullptr, nullptr,
+                     nullptr) != SQLITE_OK)
+      return false;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+                           "select m.rowid, m.subject, b.body, b.codec, "
+                           "b.dict_id, b.size from messages m "
+                           "join message_bodies b on b.id = m.body_id",
+                           -1, &stmt, nullptr) != SQLITE_OK)
+      return false;
+    bool ok = true;
+    size_t skipped = 0;
+    std::string text;
+    while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+      text.resize(sqlite3_column_int64(stmt, 5));
+      if (!unpackBody(sqlite3_column_int(stmt, 3),
+                      sqlite3_column_int64(stmt, 4),
+                      sqlite3_column_blob(stmt, 2),
+                      sqlite3_column_bytes(stmt, 2), text.data(),
+                      text.size())) {
+        skipped++;
+        continue;
+      }
+      ok = indexMessage(sqlite3_column_int64(stmt, 0), columnText(stmt, 1),
+                        text);
+    }
+    sqlite3_finalize(stmt);
+    if (skipped != 0)
+      std::cerr << db_path << ": " << skipped
+                << " unreadable bodies left out of the search index\n";
+    return ok;
+  }
+
+  static std::string_view columnText(sqlite3_stmt *stmt, int col) {
+    auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, col));
+    if (text == nullptr)
+      return {};
+    return {text, static_cast<size_t>(sqlite3_column_bytes(stmt, col))};
+  }
+
+  sqlite3_int64 newestBody() {
+    ReadConnection conn(*this);
+    return pragmaInt(conn, "select max(id) from message_bodies");
+  }
+
+  static sqlite3_int64 pragmaInt(sqlite3 *conn, const char *sql) {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 value = -1;
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) != SQLITE_OK)
+      return value;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return value;
+  }
+
+  void maintain() {
+    using namespace std::chrono;
+    auto tick = milliseconds(envOr("MAIL_DB_MAINTENANCE_MS", 1000));
+    auto slice = milliseconds(envOr("MAIL_DB_MAINTENANCE_SLICE_MS", 20));
+    auto analyze_every = seconds(envOr("MAIL_DB_ANALYZE_S", 3600));
+    auto next_analyze = steady_clock::now() + tick;
+    bool training = compress_threshold != 0 && dict_retrain != 0;
+    // The newest body id when the current dictionary was trained. Every
+    // worker writes bodies but only one runs maintenance, so new bodies are
+    // counted from the table rather than by the process storing them.
+    sqlite3_int64 trained_through = -1;
+
+    std::unique_lock<std::mutex> lock(maintenance_mtx);
+    while (!stopping) {
+      maintenance_cv.wait_for(lock, tick, [this] { return stopping; });
+      if (stopping)
+        break;
+      maintenance.ticks++;
+      // Training isn't held back for traffic: it only takes write_mtx to
+      // store the result, and a busy shard is the one whose bodies changed.
+      if (training) {
+        lock.unlock();
+        sqlite3_int64 newest = newestBody();
+        bool due = trained_through >= 0 &&
+                   newest - trained_through >=
+                       static_cast<sqlite3_int64>(dict_retrain);
+        if (newest >= 0 && (trained_through < 0 || due))
+          trained_through = newest;
+        int64_t us = 0;
+        if (due) {
+          auto started = steady_clock::now();
+          trainDictionary();
+          us = duration_cast<microseconds>(steady_clock::now() - started)
+                   .count();
+        }
+        lock.lock();
+        if (due) {
+          maintenance.trainings++;
+          maintenance.last_training_us = us;
+        }
+        if (stopping)
+          break;
+      }
+      if (!idle()) {
+        maintenance.deferred++;
+        continue;
+      }
+      lock.unlock();
+
+      auto deadline = steady_clock::now() + slice;
+      uint64_t reclaimed = 0;
+      while (steady_clock::now() < deadline && idle()) {
+        std::unique_lock<std::mutex> write(write_mtx);
+        sqlite3_int64 free = pragmaInt(db, "pragma freelist_count");
+        if (free < static_cast<sqlite3_int64>(std::max<size_t>(
+                       vacuum_min_pages, 1)))
+          break;
+        auto started = steady_clock::now();
+        std::string step =
+            "pragma incremental_vacuum(" + std::to_string(vacuum_pages) + ")";
+        if (sqlite3_exec(db, step.c_str(), nullptr, nullptr, nullptr) !=
+            SQLITE_OK)
+          break;
+        int64_t us =
+            duration_cast<microseconds>(steady_clock::now() - started).count();
+        sqlite3_int64 left = pragmaInt(db, "pragma freelist_count");
+        write.unlock();
+
+        std::lock_guard<std::mutex> stats(maintenance_mtx);
+        maintenance.vacuum_steps++;
+        maintenance.total_step_us += us;
+        maintenance.max_step_us = std::max(maintenance.max_step_us, us);
+        if (left >= 0 && left < free)
+          reclaimed += free - left;
+      }
+
+      // In WAL mode the file only shrinks when the pages past the new end
+      // have been checkpointed.
+      if (reclaimed > 0)
+        requestCheckpoint();
+
+      bool analyze = steady_clock::now() >= next_analyze && idle();
+      int64_t analyze_us = 0;
+      if (analyze) {
+        // analysis_limit bounds ANALYZE to a sample of each index.
+        auto started = steady_clock::now();
+        std::lock_guard<std::mutex> write(write_mtx);
+        sqlite3_exec(db, "pragma analysis_limit=400; analyze;", nullptr,
+                     nullptr, nullptr);
+        analyze_us =
+            duration_cast<microseconds>(steady_clock::now() - started).count();
+        next_analyze = steady_clock::now() + analyze_every;
+      }
+
+      lock.lock();
+      maintenance.reclaimed_pages += reclaimed;
+      if (analyze) {
+        maintenance.analyze_runs++;
+        maintenance.last_analyze_us = analyze_us;
+      }
+    }
+  }
+
+  // Runs on the writer's thread after each commit, with write_mtx held.
+  static int walCommitted(void *self, sqlite3 *, const char *, int frames) {
+    auto &owner = *static_cast<SqliteDatabase *>(self);
+    owner.wal_frames.store(frames, std::memory_order_relaxed);
+    int done = owner.backfilled.load(std::memory_order_relaxed);
+    int waiting = frames >= done ? frames - done : frames;
+    if (waiting >= owner.checkpoint_pages)
+      owner.requestCheckpoint();
+    return SQLITE_OK;
+  }
+
+  void requestCheckpoint() {
+    if (!checkpoint_wanted.exchange(true))
+      checkpoint_cv.notify_one();
+  }
+
+  size_t activeReaders() {
+    std::lock_guard<std::mutex> lock(readers_mtx);
+    return readers.size() - idle_readers.size() + snapshots.load();
+  }
+
+  // A request can be missed if it lands just before the wait starts; the
+  // tick bounds how late it is picked up.
+  void checkpoint() {
+    using namespace std::chrono;
+    auto tick = milliseconds(envOr("MAIL_DB_CHECKPOINT_MS", 100));
+
+    std::unique_lock<std::mutex> lock(maintenance_mtx);
+    while (!stopping) {
+      checkpoint_cv.wait_for(lock, tick, [this] {
+        return stopping || checkpoint_wanted.load();
+      });
+      if (stopping)
+        break;
+      bool wanted = checkpoint_wanted.exchange(false);
+      int frames = wal_frames.load();
+      int done = backfilled.load();
+      int waiting = frames >= done ? frames - done : frames;
+      if (!wanted && waiting < checkpoint_pages && frames < restart_pages)
+        continue;
+
+      int mode = SQLITE_CHECKPOINT_PASSIVE;
+      if (frames >= restart_pages) {
+        if (activeReaders() == 0)
+          mode = SQLITE_CHECKPOINT_RESTART;
+        else
+          checkpoints.restarts_deferred++;
+      }
+      // With every frame copied back and the WAL still short, a deferred
+      // restart is all that is left to do, and a passive pass would copy
+      // nothing.
+      if (mode == SQLITE_CHECKPOINT_PASSIVE && !wanted &&
+          waiting < checkpoint_pages)
+        continue;
+      lock.unlock();
+
+      int log = -1;
+      int copied = -1;
+      auto started = steady_clock::now();
+      int rc = sqlite3_wal_checkpoint_v2(checkpoint_db, nullptr, mode, &log,
+                                         &copied);
+      int64_t us =
+          duration_cast<microseconds>(steady_clock::now() - started).count();
+
+      lock.lock();
+      if (rc == SQLITE_OK && log >= 0) {
+        // After a restart the next commit starts the WAL over.
+        bool reset = mode == SQLITE_CHECKPOINT_RESTART;
+        wal_frames = reset ? 0 : log;
+        backfilled = reset ? 0 : copied;
+        checkpoints.frames += std::max(copied - (done <= log ? done : 0), 0);
+      }
+      if (rc == SQLITE_BUSY)
+        checkpoints.busy++;
+      else if (mode == SQLITE_CHECKPOINT_RESTART)
+        checkpoints.restarts++;
+      else
+        checkpoints.passive++;
+      checkpoints.total_us += us;
+      checkpoints.max_us = std::max(checkpoints.max_us, us);
+      checkpoints.last_us = us;
+    }
+  }
+
+public:
+  SqliteDatabase(const std::string &db_path, size_t read_connections = 4)
+      : db_path(db_path) {
+    int rc = sqlite3_open(db_path.c_str(), &db);
+    if (rc) {
+      std::cerr << "Can't open database: " << sqlite3_errmsg(db) << '\n';
+      throw std::runtime_error("Failed to open database");
+    }
+    sqlite3_busy_timeout(db, 5000);
+    // Only takes effect on a new file; migrateAutoVacuum converts old ones.
+    sqlite3_exec(db,
+                 "pragma auto_vacuum=incremental; pragma journal_mode=wal; "
+                 "pragma synchronous=normal;",
+                 nullptr, nullptr, nullptr);
+    initTables();
+
+    if (read_connections == 0)
+      read_connections = 1;
+    for (size_t i = 0; i < read_connections; i++) {
+      sqlite3 *reader;
+      if (sqlite3_open_v2(db_path.c_str(), &reader,
+                          SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                          nullptr) != SQLITE_OK) {
+        std::cerr << "Can't open read connection: " << sqlite3_errmsg(reader)
+                  << '\n';
+        sqlite3_close(reader);
+        continue;
+      }
+      sqlite3_busy_timeout(reader, 5000);
+      registerFunctions(reader);
+      readers.push_back(reader);
+    }
+    if (readers.empty())
+      readers.push_back(db);
+    idle_readers = readers;
+  }
+
+  ~SqliteDatabase() override {
+    {
+      std::lock_guard<std::mutex> lock(maintenance_mtx);
+      stopping = true;
+    }
+    maintenance_cv.notify_all();
+    checkpoint_cv.notify_all();
+    if (maintainer.joinable())
+      maintainer.join();
+    if (checkpointer.joinable())
+      checkpointer.join();
+    sqlite3_close(checkpoint_db);
+    for (sqlite3 *reader : readers)
+      if (reader != db)
+        sqlite3_close(reader);
+    sqlite3_close(db);
+    if (deflater_ready)
+      deflateEnd(&deflater);
+  }
+
+  void initTables() {
+    const char *sql = R"(
+	create table if not exists users (
+	id integer primary key autoincrement,
+	username text unique not null,
+	password text not null
+	);
+
+	create table if not exists messages (
+	  id text primary key,
+	  from_user text not null,
+	  to_user text not null,
+	  subject text not null,
+	  created_at timestamp default current_timestamp,
+	  body_id integer not null default 0,
+	  body_size integer not null default 0
+	  );
+
+	create table if not exists message_bodies (
+	  id integer primary key,
+	  body blob not null,
+	  hash integer,
+	  refs integer not null default 1,
+	  size integer not null default 0,
+	  codec integer not null default 0,
+	  dict_id integer
+	  );
+
+	create table if not exists body_dictionaries (
+	  id integer primary key,
+	  dictionary blob not null,
+	  created_at timestamp default current_timestamp
+	  );
+
+	  create index if not exists idx_messages_to on messages(to_user);
+	  create index if not exists idx_messages_from on messages(from_user);
+      )";
+
+    char *errMsg;
+    int rc = sqlite3_exec(db, sql, nullptr, nullptr, &errMsg);
+    if (rc != SQLITE_OK) {
+      std::cerr << "SQL error: " << errMsg << std::endl;
+      sqlite3_free(errMsg);
+    }
+
+    registerFunctions(db);
+    migrateInlineBodies();
+    migrateBodyHashes();
+    migrateBodyCodecs();
+    loadDictionaries();
+    initSearchIndex();
+    migrateAutoVacuum();
+  }
+
+  bool columnExists(const char *table, const char *column) {
+    bool exists = false;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+                           "select 1 from pragma_table_info(?) where name = ?",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+      sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+      exists = sqlite3_step(stmt) == SQLITE_ROW;
+      sqlite3_finalize(stmt);
+    }
+    return exists;
+  }
+
+  // Older databases keep the body inline in messages, which bloats every page
+  // an inbox scan touches. Move those bodies into message_bodies and drop the
+  // column; the search index is dropped too and rebuilt over the new layout.
+  void migrateInlineBodies() {
+    if (!columnExists("messages", "body"))
+      return;
+
+    const char *sql = R"(
+	begin immediate;
+	alter table messages add column body_id integer not null default 0;
+	alter table messages add column body_size integer not null default 0;
+	insert into message_bodies(id, body, size)
+	  select rowid, cast(body as blob), length(cast(body as blob))
+	  from messages;
+	update messages
+	  set body_id = rowid, body_size = length(cast(body as blob));
+	drop trigger if exists messages_fts_insert;
+	drop trigger if exists messages_fts_delete;
+	drop table if exists messages_fts;
+	alter table messages drop column body;
+	commit;
+      )";
+
+    char *errMsg;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) != SQLITE_OK) {
+      std::cerr << "Body migration failed: " << errMsg << std::endl;
+      sqlite3_free(errMsg);
+      sqlite3_exec(db, "rollback", nullptr, nullptr, nullptr);
+    }
+  }
+
+  // Bodies stored before deduplication have no hash or reference count. Each
+  // keeps a single reference; later identical bodies can share them.
+  void migrateBodyHashes() {
+    const char *sql = R"(
+	begin immediate;
+	alter table message_bodies add column hash integer;
+	alter table message_bodies add column refs integer not null default 1;
+	commit;
+      )";
+
+    char *errMsg;
+    if (!columnExists("message_bodies", "hash") &&
+        sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) != SQLITE_OK) {
+      std::cerr << "Body hash migration failed: " << errMsg << std::endl;
+      sqlite3_free(errMsg);
+      sqlite3_exec(db, "rollback", nullptr, nullptr, nullptr);
+      return;
+    }
+
+    sqlite3_exec(db,
+                 "create index if not exists idx_message_bodies_hash on "
+                 "message_bodies(hash);"
+                 "update message_bodies set hash = content_hash(body) "
+                 "where hash is null;",
+                 nullptr, nullptr, nullptr);
+  }
+
+  // Bodies stored before compression are all raw, so their stored length is
+  // their size.
+  void migrateBodyCodecs() {
+    if (columnExists("message_bodies", "codec"))
+      return;
+
+    const char *sql = R"(
+	begin immediate;
+	alter table message_bodies add column size integer not null default 0;
+	alter table message_bodies add column codec integer not null default 0;
+	alter table message_bodies add column dict_id integer;
+	update message_bodies set size = length(body);
+	commit;
+      )";
+
+    char *errMsg;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) != SQLITE_OK) {
+      std::cerr << "Body codec migration failed: " << errMsg << std::endl;
+      sqlite3_free(errMsg);
+      sqlite3_exec(db, "rollback", nullptr, nullptr, nullptr);
+    }
+  }
+
+  // auto_vacuum can only be switched on an existing file by a full VACUUM,
+  // done once here. VACUUM may renumber the messages rowids the search index
+  // is keyed by, so the index is refilled after it.
+  void migrateAutoVacuum() {
+    if (pragmaInt(db, "pragma auto_vacuum") == 2)
+      return;
+    std::cerr << "Enabling incremental auto_vacuum on " << db_path
+              << " (one-time VACUUM)\n";
+    char *errMsg;
+    if (sqlite3_exec(db, "pragma auto_vacuum=incremental; vacuum;", nullptr,
+                     nullptr, &errMsg) != SQLITE_OK) {
+      std::cerr << "SQL error: " << errMsg << std::endl;
+      sqlite3_free(errMsg);
+      return;
+    }
+    sqlite3_exec(db, "begin immediate", nullptr, nullptr, nullptr);
+    sqlite3_exec(db, reindexSearch() ? "commit" : "rollback", nullptr, nullptr,
+                 nullptr);
+  }
+
+  // FTS5 index over messages holding its own copy of the subject and body.
+  // insertMessage adds rows and a trigger drops them, so every delete path
+  // (including deleteUser's bulk deletes and the sqlite3 shell) maintains
+  // it. Older files used an external-content index reading bodies through an
+  // app-defined function; that layout is replaced and the index refilled.
+  void initSearchIndex() {
+    std::string layout;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+                           "select sql from sqlite_master where type = 'table' "
+                           "and name = 'messages_fts'",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+        layout = columnText(stmt, 0);
+      sqlite3_finalize(stmt);
+    }
+    bool refill =
+        layout.empty() || layout.find("content=") != std::string::npos;
+
+    const char *create = R"(
+	drop trigger if exists messages_fts_insert;
+	drop trigger if exists messages_delete;
+	drop view if exists message_text;
+	drop table if exists messages_fts;
+	create virtual table messages_fts using fts5(
+	  subject, body, tokenize='unicode61'
+	  );
+      )";
+
+    // The trigger is recreated on every start so its definition follows the
+    // code.
+    const char *sql = R"(
+	drop trigger if exists messages_delete;
+	create trigger messages_delete after delete on messages
+	begin
+	  delete from messages_fts where rowid = old.rowid;
+	  update message_bodies set refs = refs - 1 where id = old.body_id;
+	  delete from message_bodies where id = old.body_id and refs <= 0;
+	end;
+      )";
+
+    char *errMsg = nullptr;
+    sqlite3_exec(db, "begin immediate", nullptr, nullptr, nullptr);
+    bool ok = (!refill ||
+               sqlite3_exec(db, create, nullptr, nullptr, &errMsg) ==
+                   SQLITE_OK) &&
+              sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) == SQLITE_OK &&
+              (!refill || reindexSearch());
+    if (!ok) {
+      std::cerr << "Search index setup failed: "
+                << (errMsg ? errMsg : sqlite3_errmsg(db)) << std::endl;
+      sqlite3_free(errMsg);
+    }
+    sqlite3_exec(db, ok ? "commit" : "rollback", nullptr, nullptr, nullptr);
+  }
+
+  bool createUser(const std::string &username,
+                  const std::string &password) override {
+    std::lock_guard<std::mutex> lock(write_mtx);
+    sqlite3_stmt *stmt;
+    const char *sql = "INSERT INTO users (username, password) VALUES (?, ?)";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return false;
+    }
+
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, password.c_str(), -1, SQLITE_TRANSIENT);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    return rc == SQLITE_DONE;
+  }
+
+  std::optional<std::string> getPassword(const std::string &username) override {
+    ReadConnection conn(*this);
+    sqlite3_stmt *stmt;
+    const char *sql = "select password from users where username = ?";
+
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return std::nullopt;
+    }
+
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+
+    std::optional<std::string> password;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      password = std::string(columnText(stmt, 0));
+
+    sqlite3_finalize(stmt);
+    return password;
+  }
+
+  bool setPassword(const std::string &username,
+                   const std::string &password) override {
+    std::lock_guard<std::mutex> lock(write_mtx);
+    sqlite3_stmt *stmt;
+    const char *sql = "update users set password = ? where username = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return false;
+    }
+
+    sqlite3_bind_text(stmt, 1, password.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, username.c_str(), -1, SQLITE_TRANSIENT);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    return rc == SQLITE_DONE;
+  }
+
+  bool userExists(const std::string &username) override {
+    ReadConnection conn(*this);
+    sqlite3_stmt *stmt;
+    const char *sql = "select 1 from users where username = ?";
+
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return false;
+    }
+
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+
+    bool exists = (sqlite3_step(stmt) == SQLITE_ROW);
+    sqlite3_finalize(stmt);
+    return exists;
+  }
+
+  bool createMessage(const Message &msg) override {
+    std::lock_guard<std::mutex> lock(write_mtx);
+    if (sqlite3_exec(db, "begin immediate", nullptr, nullptr, nullptr) !=
+        SQLITE_OK)
+      return false;
+
+    bool ok = insertMessage(msg, {});
+    sqlite3_exec(db, ok ? "commit" : "rollback", nullptr, nullptr, nullptr);
+    return ok;
+  }
+
+  // Small bodies come back with the header row; large ones are left out of
+  // the scan and read with incremental blob I/O. Either way they are decoded
+  // straight into the message's buffer.
+  Inbox getMessagesForUser(const std::string &username) override {
+    ReadConnection conn(*this);
+    Inbox messages;
+    sqlite3_stmt *stmt;
+    const char *sql =
+        "select m.id, m.from_user, m.to_user, m.subject, m.body_id, "
+        "m.body_size, b.codec, b.dict_id, "
+        "case when length(b.body) <= ? then b.body end "
+        "from messages m join message_bodies b on b.id = m.body_id "
+        "where m.to_user = ? order by m.created_at desc";
+
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return messages;
+    }
+
+    sqlite3_bind_int64(stmt, 1, stream_threshold);
+    sqlite3_bind_text(stmt, 2, username.c_str(), -1, SQLITE_TRANSIENT);
+
+    sqlite3_blob *blob = nullptr;
+    std::string packed;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      sqlite3_int64 body_id = sqlite3_column_int64(stmt, 4);
+      size_t body_size = sqlite3_column_int64(stmt, 5);
+      int codec = sqlite3_column_int(stmt, 6);
+      sqlite3_int64 dict_id = sqlite3_column_int64(stmt, 7);
+      bool ok = false;
+
+      if (sqlite3_column_type(stmt, 8) != SQLITE_NULL) {
+        std::string_view stored = columnText(stmt, 8);
+        messages.emplace_back(columnText(stmt, 1), columnText(stmt, 2),
+                              columnText(stmt, 3), body_size,
+                              columnText(stmt, 0), [&](char *out) {
+                                ok = unpackBody(codec, dict_id, stored.data(),
+                                                stored.size(), out, body_size);
+                              });
+      } else {
+        int rc = blob ? sqlite3_blob_reopen(blob, body_id)
+                      : sqlite3_blob_open(conn, "main", "message_bodies",
+                                          "body", body_id, 0, &blob);
+        messages.emplace_back(
+            columnText(stmt, 1), columnText(stmt, 2), columnText(stmt, 3),
+            body_size, columnText(stmt, 0), [&](char *out) {
+              if (rc != SQLITE_OK)
+                return;
+              size_t stored = sqlite3_blob_bytes(blob);
+              if (codec == static_cast<int>(BodyCodec::Raw)) {
+                ok = stored == body_size &&
+                     sqlite3_blob_read(blob, out, body_size, 0) == SQLITE_OK;
+                return;
+              }
+              packed.resize(stored);
+              ok = sqlite3_blob_read(blob, packed.data(), stored, 0) ==
+                       SQLITE_OK &&
+                   unpackBody(codec, dict_id, packed.data(), stored, out,
+                              body_size);
+            });
+      }
+
+      if (!ok) {
+        std::cerr << "Failed to read body " << body_id << '\n';
+        messages.pop_back();
+      }
+    }
+
+    sqlite3_blob_close(blob);
+    sqlite3_finalize(stmt);
+    return messages;
+  }
+
+  bool deleteMessage(const std::string &username,
+                     const std::string &msg_id) override {
+    std::lock_guard<std::mutex> lock(write_mtx);
+    sqlite3_stmt *stmt;
+    const char *sql = "delete from messages where id = ? and to_user = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return false;
+    }
+
+    sqlite3_bind_text(stmt, 1, msg_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, username.c_str(), -1, SQLITE_TRANSIENT);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    return rc == SQLITE_DONE && sqlite3_changes(db) > 0;
+  }
+
+  bool deleteUser(const std::string &username) override {
+    std::lock_guard<std::mutex> lock(write_mtx);
+    sqlite3_stmt *stmt;
+    const char *sql = "delete from messages where to_user = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return false;
+    }
+
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    const char *sql2 = "delete from messages where from_user = ?";
+    if (sqlite3_prepare_v2(db, sql2, -1, &stmt, nullptr) != SQLITE_OK) {
+      return false;
+    }
+
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    const char *sql3 = "delete from users where username = ?";
+    if (sqlite3_prepare_v2(db, sql3, -1, &stmt, nullptr) != SQLITE_OK) {
+      return false;
+    }
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    return rc == SQLITE_DONE && sqlite3_changes(db) > 0;
+  }
+
+  void deleteMessagesOf(const std::string &username) override {
+    std::lock_guard<std::mutex> lock(write_mtx);
+    sqlite3_stmt *stmt;
+    const char *sql =
+        "delete from messages where to_user = ?1 or from_user = ?1";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+      return;
+
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+  }
+
+  // Results are ordered by bm25 rank. Each whitespace-separated word of the
+  // query is matched as a quoted term (the last one as a prefix) so user
+  // input can't inject FTS5 query syntax.
+  MessageRows searchMessages(const std::string &username,
+                             const std::string &query, int limit, int offset,
+                             std::pmr::memory_resource *mr) override {
+    MessageRows messages(mr);
+
+    std::string match;
+    std::istringstream words(query);
+    std::string word;
+    while (words >> word) {
+      if (!match.empty())
+        match += ' ';
+      match += '"';
+      for (char c : word) {
+        if (c == '"')
+          match += '"';
+        match += c;
+      }
+      match += '"';
+    }
+    if (match.empty())
+      return messages;
+    match += '*';
+
+    ReadConnection conn(*this);
+    sqlite3_stmt *stmt;
+    const char *sql =
+        "select m.id, m.from_user, m.to_user, m.subject, b.body, b.codec, "
+        "b.dict_id, b.size from "
+        "messages_fts join messages m on m.rowid = messages_fts.rowid "
+        "join message_bodies b on b.id = m.body_id "
+        "where messages_fts match ? and m.to_user = ? "
+        "order by bm25(messages_fts) limit ? offset ?";
+
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return messages;
+    }
+
+    sqlite3_bind_text(stmt, 1, match.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, username.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 3, limit);
+    sqlite3_bind_int(stmt, 4, offset);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      MessageRow &m = messages.emplace_back();
+      m.id = columnText(stmt, 0);
+      m.from = columnText(stmt, 1);
+      m.to = columnText(stmt, 2);
+      m.subject = columnText(stmt, 3);
+      std::string_view stored = columnText(stmt, 4);
+      m.body.resize(sqlite3_column_int64(stmt, 7));
+      if (!unpackBody(sqlite3_column_int(stmt, 5),
+                      sqlite3_column_int64(stmt, 6), stored.data(),
+                      stored.size(), m.body.data(), m.body.size())) {
+        std::cerr << "Failed to read body of " << m.id << '\n';
+        messages.pop_back();
+      }
+    }
+
+    sqlite3_finalize(stmt);
+    return messages;
+  }
+
+  // Logical bytes count every message's body, unique bytes each distinct
+  // body once, and stored bytes what is on disk after compression.
+  json bodyStats() override {
+    ReadConnection conn(*this);
+    json stats = json::object();
+    sqlite3_stmt *stmt;
+    const char *sql =
+        "select (select count(*) from messages), "
+        "(select coalesce(sum(body_size), 0) from messages), count(*), "
+        "coalesce(sum(size), 0), coalesce(sum(length(body)), 0), "
+        "count(nullif(codec, 0)) from message_bodies";
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) != SQLITE_OK)
+      return stats;
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      sqlite3_int64 logical = sqlite3_column_int64(stmt, 1);
+      sqlite3_int64 unique = sqlite3_column_int64(stmt, 3);
+      sqlite3_int64 stored = sqlite3_column_int64(stmt, 4);
+      auto ratio = [](sqlite3_int64 a, sqlite3_int64 b) {
+        return b > 0 ? static_cast<double>(a) / b : 1.0;
+      };
+      sqlite3_int64 dict_id = current_dict.load();
+      auto dict = dictionary(dict_id);
+      stats = {{"messages", sqlite3_column_int64(stmt, 0)},
+               {"unique_bodies", sqlite3_column_int64(stmt, 2)},
+               {"compressed_bodies", sqlite3_column_int64(stmt, 5)},
+               {"logical_bytes", logical},
+               {"unique_bytes", unique},
+               {"stored_bytes", stored},
+               {"saved_bytes", logical - stored},
+               {"dedup_ratio", ratio(logical, unique)},
+               {"compression_ratio", ratio(unique, stored)},
+               {"dictionary",
+                {{"version", dict_id}, {"bytes", dict ? dict->size() : 0}}}};
+    }
+    sqlite3_finalize(stmt);
+    return stats;
+  }
+
+  std::vector<std::string> recipients() override {
+    ReadConnection conn(*this);
+    std::vector<std::string> users;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(conn, "select distinct to_user from messages", -1,
+                           &stmt, nullptr) != SQLITE_OK)
+      return users;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      users.emplace_back(columnText(stmt, 0));
+    sqlite3_finalize(stmt);
+    return users;
+  }
+
+  std::optional<std::vector<StoredMessage>>
+  exportInbox(const std::string &username) override {
+    ReadConnection conn(*this);
+    sqlite3_stmt *stmt;
+    const char *sql =
+        "select m.id, m.from_user, m.to_user, m.subject, m.created_at, b.body, "
+        "b.codec, b.dict_id, b.size from messages m "
+        "join message_bodies b on b.id = m.body_id where m.to_user = ? "
+        "order by m.created_at, m.rowid";
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) != SQLITE_OK)
+      return std::nullopt;
+
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    std::vector<StoredMessage> messages;
+    bool ok = true;
+    while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+      std::string body(sqlite3_column_int64(stmt, 8), '\0');
+      ok = unpackBody(sqlite3_column_int(stmt, 6),
+                      sqlite3_column_int64(stmt, 7),
+                      sqlite3_column_blob(stmt, 5),
+                      sqlite3_column_bytes(stmt, 5), body.data(), body.size());
+      messages.push_back(
+          {Message(std::string(columnText(stmt, 1)),
+                   std::string(columnText(stmt, 2)),
+                   std::string(columnText(stmt, 3)), std::move(body),
+                   std::string(columnText(stmt, 0))),
+           std::string(columnText(stmt, 4))});
+    }
+    sqlite3_finalize(stmt);
+    if (!ok)
+      return std::nullopt;
+    return messages;
+  }
+
+  bool importMessages(const std::vector<StoredMessage> &messages) override {
+    std::lock_guard<std::mutex> lock(write_mtx);
+    if (sqlite3_exec(db, "begin immediate", nullptr, nullptr, nullptr) !=
+        SQLITE_OK)
+      return false;
+
+    sqlite3_stmt *exists;
+    bool ok = sqlite3_prepare_v2(db, "select 1 from messages where id = ?", -1,
+                                 &exists, nullptr) == SQLITE_OK;
+    for (size_t i = 0; ok && i < messages.size(); i++) {
+      const StoredMessage &stored = messages[i];
+      sqlite3_reset(exists);
+      sqlite3_bind_text(exists, 1, stored.msg.id.c_str(), -1,
+                        SQLITE_TRANSIENT);
+      if (sqlite3_step(exists) != SQLITE_ROW)
+        ok = insertMessage(stored.msg, stored.created_at);
+    }
+    sqlite3_finalize(exists);
+
+    sqlite3_exec(db, ok ? "commit" : "rollback", nullptr, nullptr, nullptr);
+    return ok;
+  }
+
+  bool deleteInbox(const std::string &username) override {
+    std::lock_guard<std::mutex> lock(write_mtx);
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "delete from messages where to_user = ?", -1,
+                           &stmt, nullptr) != SQLITE_OK)
+      return false;
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE;
+  }
+
+  void startMaintenance(std::function<bool()> idle) override {
+    this->idle = std::move(idle);
+    maintainer = std::thread([this] { maintain(); });
+  }
+
+  void startCheckpoints() override {
+    if (sqlite3_open_v2(db_path.c_str(), &checkpoint_db,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,
+                        nullptr) != SQLITE_OK) {
+      std::cerr << "Can't open checkpoint connection: "
+                << sqlite3_errmsg(checkpoint_db)
+                << "; leaving checkpoints to SQLite\n";
+      sqlite3_close(checkpoint_db);
+      checkpoint_db = nullptr;
+      return;
+    }
+    sqlite3_busy_timeout(checkpoint_db,
+                         envOr("MAIL_DB_CHECKPOINT_WAIT_MS", 50));
+    // The pager only opens the WAL once the connection has read something;
+    // until then a checkpoint is a no-op.
+    sqlite3_exec(checkpoint_db, "select count(*) from sqlite_schema", nullptr,
+                 nullptr, nullptr);
+    // Replaces wal_autocheckpoint. Past a restart the WAL file is cut back
+    // to the restart threshold rather than keeping its high-water size.
+    std::lock_guard<std::mutex> lock(write_mtx);
+    std::string limit =
+        "pragma journal_size_limit=" +
+        std::to_string(static_cast<sqlite3_int64>(restart_pages) *
+                       pragmaInt(db, "pragma page_size"));
+    sqlite3_exec(db, limit.c_str(), nullptr, nullptr, nullptr);
+    sqlite3_wal_hook(db, walCommitted, this);
+    checkpointer = std::thread([this] { checkpoint(); });
+  }
+
+  // The source is a connection of its own, so the copy never holds
+  // write_mtx. Its read transaction pins one snapshot for the whole copy:
+  // commits made meanwhile neither restart the backup nor end up in it.
+  bool backup(const std::string &path, int pages_per_step,
+              const std::function<bool(int64_t, int64_t)> &step) override {
+    sqlite3 *source = nullptr;
+    sqlite3 *target = nullptr;
+    sqlite3_backup *copy = nullptr;
+    bool snapshot = false;
+    int rc = SQLITE_ERROR;
+    if (sqlite3_open_v2(db_path.c_str(), &source,
+                        SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                        nullptr) == SQLITE_OK &&
+        sqlite3_open(path.c_str(), &target) == SQLITE_OK) {
+      sqlite3_busy_timeout(source, 5000);
+      snapshot = sqlite3_exec(source,
+                              "begin; select count(*) from sqlite_schema;",
+                              nullptr, nullptr, nullptr) == SQLITE_OK;
+    }
+    if (snapshot) {
+      snapshots++;
+      copy = sqlite3_backup_init(target, "main", source, "main");
+    }
+
+    if (copy) {
+      sqlite3_int64 page_size = pragmaInt(source, "pragma page_size");
+      do {
+        rc = sqlite3_backup_step(copy, pages_per_step);
+        int total = sqlite3_backup_pagecount(copy);
+        int done = total - sqlite3_backup_remaining(copy);
+        if (rc != SQLITE_DONE && !step(done * page_size, total * page_size))
+          rc = SQLITE_INTERRUPT;
+      } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+      if (sqlite3_backup_finish(copy) != SQLITE_OK && rc == SQLITE_DONE)
+        rc = SQLITE_ERROR;
+    }
+    if (rc != SQLITE_DONE && rc != SQLITE_INTERRUPT)
+      std::cerr << "Backup of " << db_path << " failed: "
+                << sqlite3_errmsg(sqlite3_errcode(source) != SQLITE_OK
+                                      ? source
+                                      : target)
+                << '\n';
+
+    if (snapshot) {
+      sqlite3_exec(source, "commit", nullptr, nullptr, nullptr);
+      snapshots--;
+    }
+    sqlite3_close(source);
+    sqlite3_close(target);
+    return rc == SQLITE_DONE;
+  }
+
+  json maintenanceStats() override {
+    sqlite3_int64 page_size;
+    sqlite3_int64 pages;
+    sqlite3_int64 free;
+    struct stat wal;
+    sqlite3_int64 wal_bytes =
+        stat((db_path + "-wal").c_str(), &wal) == 0 ? wal.st_size : 0;
+    {
+      ReadConnection conn(*this);
+      page_size = pragmaInt(conn, "pragma page_size");
+      pages = pragmaInt(conn, "pragma page_count");
+      free = pragmaInt(conn, "pragma freelist_count");
+    }
+    std::lock_guard<std::mutex> lock(maintenance_mtx);
+    const Maintenance &m = maintenance;
+    const Checkpoints &c = checkpoints;
+    json checkpointing = {{"running", checkpointer.joinable()},
+                          {"wal_frames", wal_frames.load()},
+                          {"wal_backfilled", backfilled.load()},
+                          {"wal_file_bytes", wal_bytes},
+                          {"passive", c.passive},
+                          {"restarts", c.restarts},
+                          {"restarts_deferred", c.restarts_deferred},
+                          {"busy", c.busy},
+                          {"frames_copied", c.frames},
+                          {"total_us", c.total_us},
+                          {"max_us", c.max_us},
+                          {"last_us", c.last_us}};
+    return {{"running", maintainer.joinable()},
+            {"file_bytes", pages * page_size},
+            {"free_bytes", free * page_size},
+            {"ticks", m.ticks},
+            {"deferred_busy", m.deferred},
+            {"vacuum_steps", m.vacuum_steps},
+            {"reclaimed_pages", m.reclaimed_pages},
+            {"reclaimed_bytes", m.reclaimed_pages * page_size},
+            {"total_step_us", m.total_step_us},
+            {"max_step_us", m.max_step_us},
+            {"analyze_runs", m.analyze_runs},
+            {"last_analyze_us", m.last_analyze_us},
+            {"dictionary_trainings", m.trainings},
+            {"last_training_us", m.last_training_us},
+            {"checkpoints", checkpointing}};
+  }
+
+  std::pmr::vector<std::pmr::string>
+  getUsers(std::pmr::memory_resource *mr) override {
+    ReadConnection conn(*this);
+    std::pmr::vector<std::pmr::string> users(mr);
+    sqlite3_stmt *stmt;
+    const char *sql = "select username from users order by username";
+
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+      return users;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      users.emplace_back(columnText(stmt, 0));
+    }
+
+    sqlite3_finalize(stmt);
+    return users;
+  }
+};
+
+// Purpose-built engine for the mailbox access pattern. Every change is one
+// record appended to the active segment of a log directory, and an in-memory
+// index keeps each inbox as the locations of its records, oldest first. A
+// send is a single write(); reads parse records straight out of the mapped
+// segments and hand the serializer views into them without copying.
+//
+// A segment is sealed once it reaches MAIL_DB_LOG_SEGMENT_MB, by appending a
+// footer with the index fields of each of its records, so startup rebuilds
+// the index from footers and only scans the active segment. Deletes append
+// tombstones; a background compactor rewrites sealed segments in place once
+// MAIL_DB_LOG_COMPACT_PERCENT of their record bytes are reclaimable.
+class LogDatabase : public Database {
+private:
+  enum class Op : char {
+    PutUser = 'U',
+    PutMessage = 'M',
+    DeleteMessage = 'D',
+    DeleteInbox = 'I',
+    DeleteUser = 'X',
+    Footer = 'F',
+  };
+
+  // After the magic, each record is a u32 LE payload length and the
+  // payload's crc32, then the op byte and u32-length-prefixed fields.
+  // Messages hold id, from, to, subject, created_at and body, in that order.
+  // A footer is a record whose payload is the op byte and one entry per
+  // record, followed by its offset and a second magic.
+  static constexpr char magic[8] = {'M', 'A', 'I', 'L', 'L', 'O', 'G', '1'};
+  static constexpr char footer_magic[8] = {'M', 'A', 'I', 'L',
+                                           'I', 'D', 'X', '1'};
+  static constexpr size_t header_size = 8;
+  static constexpr size_t trailer_size = 16;
+  static constexpr size_t max_fields = 6;
+
+  struct Record {
+    Op op;
+    std::array<std::string_view, max_fields> fields;
+    size_t count = 0;
+  };
+
+  // What the index needs from a record, and what a footer keeps of it: the
+  // key fields (id, from, to for messages; username and password for users;
+  // to, id for a message tombstone; the username for the others) and where
+  // the record is.
+  struct IndexEntry {
+    Op op;
+    std::array<std::string_view, 3> keys;
+    uint32_t segment;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t body_size;
+  };
+
+  struct Entry {
+    std::string id;
+    std::string from;
+    uint32_t segment;
+    uint32_t size;
+    uint64_t offset;
+    uint32_t body_size;
+  };
+
+  struct UserRecord {
+    std::string password;
+    uint32_t segment;
+    uint32_t size;
+    uint64_t offset;
+  };
+
+  // data maps the whole file, and the active segment's mapping extends past
+  // its end to leave room for appends. Readers copy the pointer, so a
+  // mapping outlives the compaction that replaced it for as long as views
+  // into it are held.
+  struct Segment {
+    std::shared_ptr<const char[]> data;
+    uint64_t records_end;
+    uint64_t size;
+    uint64_t live = 0;
+    uint64_t tombstones = 0;
+  };
+
+  std::filesystem::path dir;
+  const uint64_t segment_bytes = envOr("MAIL_DB_LOG_SEGMENT_MB", 64) << 20;
+  const size_t compact_percent = envOr("MAIL_DB_LOG_COMPACT_PERCENT", 50);
+  const bool sync = envOr("MAIL_DB_LOG_FSYNC", 0) != 0;
+
+  std::shared_mutex mtx;
+  std::map<uint32_t, Segment> segments;
+  uint32_t active = 0;
+  int fd = -1;
+  uint64_t capacity = 0;
+  std::string active_footer;
+
+  std::map<std::string, UserRecord> users;
+  std::unordered_map<std::string, std::vector<Entry>> inboxes;
+  size_t messages = 0;
+  uint64_t logical_bytes = 0;
+
+  std::thread compactor;
+  std::mutex compact_mtx;
+  std::condition_variable compact_cv;
+  bool stopping = false;
+  std::atomic<uint64_t> compactions{0};
+  std::atomic<uint64_t> reclaimed_bytes{0};
+  std::atomic<int64_t> last_compaction_us{0};
+  std::atomic<int64_t> last_compaction_locked_us{0};
+
+  static uint32_t readU32(const char *p) {
+    auto u = reinterpret_cast<const unsigned char *>(p);
+    return u[0] | u[1] << 8 | u[2] << 16 | static_cast<uint32_t>(u[3]) << 24;
+  }
+
+  static void writeU32(char *p, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+      p[i] = static_cast<char>(value >> (8 * i));
+  }
+
+  static uint64_t readU64(const char *p) {
+    return readU32(p) | static_cast<uint64_t>(readU32(p + 4)) << 32;
+  }
+
+  static void writeU64(char *p, uint64_t value) {
+    writeU32(p, static_cast<uint32_t>(value));
+    writeU32(p + 4, static_cast<uint32_t>(value >> 32));
+  }
+
+  static void putField(std::string &out, std::string_view field) {
+    char size[4];
+    writeU32(size, field.size());
+    out.append(size, 4);
+    out += field;
+  }
+
+  static std::optional<Record> parse(std::string_view payload) {
+    if (payload.empty())
+      return std::nullopt;
+    Record record{static_cast<Op>(payload[0]), {}};
+    payload.remove_prefix(1);
+    while (!payload.empty()) {
+      if (record.count == max_fields || payload.size() < 4)
+        return std::nullopt;
+      uint32_t size = readU32(payload.data());
+      payload.remove_prefix(4);
+      if (size > payload.size())
+        return std::nullopt;
+      record.fields[record.count++] = payload.substr(0, size);
+      payload.remove_prefix(size);
+    }
+    return record;
+  }
+
+  static std::string frame(Op op, std::string_view payload) {
+    std::string record(header_size, '\0');
+    record += static_cast<char>(op);
+    record += payload;
+    uint32_t size = record.size() - header_size;
+    writeU32(record.data(), size);
+    writeU32(record.data() + 4,
+             crc32(0, reinterpret_cast<const Bytef *>(record.data()) +
+                          header_size,
+                   size));
+    return record;
+  }
+
+  static std::optional<IndexEntry> indexEntry(const Record &record,
+                                              uint32_t segment,
+                                              uint64_t offset, uint32_t size) {
+    const auto &f = record.fields;
+    IndexEntry entry{record.op, {}, segment, offset, size, 0};
+    switch (record.op) {
+    case Op::PutMessage:
+      if (record.count != 6)
+        return std::nullopt;
+      entry.keys = {f[0], f[1], f[2]};
+      entry.body_size = f[5].size();
+      return entry;
+    case Op::PutUser:
+    case Op::DeleteMessage:
+      if (record.count != 2)
+        return std::nullopt;
+      entry.keys = {f[0], f[1], {}};
+      return entry;
+    case Op::DeleteInbox:
+    case Op::DeleteUser:
+      if (record.count != 1)
+        return std::nullopt;
+      entry.keys = {f[0], {}, {}};
+      return entry;
+    default:
+      return std::nullopt;
+    }
+  }
+
+  static void appendFooterEntry(std::string &footer, const IndexEntry &entry) {
+    std::string fields;
+    fields += static_cast<char>(entry.op);
+    size_t keys = 1;
+    if (entry.op == Op::PutMessage)
+      keys = 3;
+    else if (entry.op == Op::PutUser || entry.op == Op::DeleteMessage)
+      keys = 2;
+    for (size_t i = 0; i < keys; i++)
+      putField(fields, entry.keys[i]);
+    char location[16];
+    writeU64(location, entry.offset);
+    writeU32(location + 8, entry.size);
+    writeU32(location + 12, entry.body_size);
+    putField(fields, {location, sizeof(location)});
+    putField(footer, fields);
+  }
+
+  // Entries are parsed in place; the returned keys point into the footer.
+  static std::optional<std::vector<IndexEntry>>
+  parseFooter(std::string_view footer, uint32_t segment) {
+    std::vector<IndexEntry> entries;
+    while (!footer.empty()) {
+      if (footer.size() < 4)
+        return std::nullopt;
+      uint32_t size = readU32(footer.data());
+      if (size > footer.size() - 4)
+        return std::nullopt;
+      auto record = parse(footer.substr(4, size));
+      footer.remove_prefix(4 + size);
+      if (!record || record->count < 2 ||
+          record->fields[record->count - 1].size() != 16)
+        return std::nullopt;
+      const char *location = record->fields[record->count - 1].data();
+      IndexEntry entry{record->op, {}, segment, readU64(location),
+                       readU32(location + 8), readU32(location + 12)};
+      for (size_t i = 0; i + 1 < record->count && i < 3; i++)
+        entry.keys[i] = record->fields[i];
+      entries.push_back(entry);
+    }
+    return entries;
+  }
+
+  static std::string timestamp() {
+    time_t now = time(nullptr);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+    return text;
+  }
+
+  std::filesystem::path segmentPath(uint32_t id) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%08u.seg", id);
+    return dir / name;
+  }
+
+  static std::shared_ptr<const char[]> map(int file, uint64_t size) {
+    void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("Failed to map message log segment");
+    return std::shared_ptr<const char[]>(
+        static_cast<const char *>(data),
+        [size](const char *p) { munmap(const_cast<char *>(p), size); });
+  }
+
+  void addEntry(std::string_view to, Entry entry) {
+    messages++;
+    logical_bytes += entry.body_size;
+    segments[entry.segment].live += entry.size;
+    inboxes[std::string(to)].push_back(std::move(entry));
+  }
+
+  void dropEntry(const Entry &entry) {
+    messages--;
+    logical_bytes -= entry.body_size;
+    segments[entry.segment].live -= entry.size;
+  }
+
+  void dropMessage(const std::string &to, std::string_view id) {
+    auto inbox = inboxes.find(to);
+    if (inbox == inboxes.end())
+      return;
+    auto &entries = inbox->second;
+    auto it = std::find_if(entries.begin(), entries.end(),
+                           [id](const Entry &e) { return e.id == id; });
+    if (it == entries.end())
+      return;
+    dropEntry(*it);
+    entries.erase(it);
+  }
+
+  void dropInbox(const std::string &username) {
+    auto inbox = inboxes.find(username);
+    if (inbox == inboxes.end())
+      return;
+    for (const Entry &entry : inbox->second)
+      dropEntry(entry);
+    inboxes.erase(inbox);
+  }
+
+  // Sent messages aren't indexed by sender, so this walks every inbox; it
+  // only runs when a user is deleted.
+  void dropUser(const std::string &username) {
+    auto user = users.find(username);
+    if (user != users.end()) {
+      segments[user->second.segment].live -= user->second.size;
+      users.erase(user);
+    }
+    dropInbox(username);
+    for (auto &[to, entries] : inboxes)
+      entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                   [&](const Entry &e) {
+                                     if (e.from != username)
+                                       return false;
+                                     dropEntry(e);
+                                     return true;
+                                   }),
+                    entries.end());
+  }
+
+  // Applies a record to the index, whether it was just appended or comes
+  // from replaying a segment or its footer.
+  void apply(const IndexEntry &e) {
+    switch (e.op) {
+    case Op::PutUser: {
+      std::string username(e.keys[0]);
+      auto user = users.find(username);
+      if (user != users.end())
+        segments[user->second.segment].live -= user->second.size;
+      users[username] = {std::string(e.keys[1]), e.segment, e.size, e.offset};
+      segments[e.segment].live += e.size;
+      return;
+    }
+    case Op::PutMessage:
+      addEntry(e.keys[2], {std::string(e.keys[0]), std::string(e.keys[1]),
+                           e.segment, e.size, e.offset, e.body_size});
+      return;
+    case Op::DeleteMessage:
+      dropMessage(std::string(e.keys[0]), e.keys[1]);
+      break;
+    case Op::DeleteInbox:
+      dropInbox(std::string(e.keys[0]));
+      break;
+    case Op::DeleteUser:
+      dropUser(std::string(e.keys[0]));
+      break;
+    default:
+      return;
+    }
+    segments[e.segment].tombstones += e.size;
+  }
+
+  // Called with mtx held exclusively. A failed write is cut back off so the
+  // next record starts on a boundary.
+  bool append(Op op, std::initializer_list<std::string_view> fields) {
+    std::string payload;
+    for (std::string_view field : fields)
+      putField(payload, field);
+    std::string record = frame(op, payload);
+
+    Segment &segment = segments[active];
+    if (segment.records_end + record.size() > capacity) {
+      if (!roll(record.size()))
+        return false;
+      return append(op, fields);
+    }
+
+    if (!writeAll(fd, record.data(), record.size()) ||
+        (sync && fdatasync(fd) != 0)) {
+      std::cerr << "message log " << dir << ": write failed\n";
+      if (ftruncate(fd, segment.records_end) != 0)
+        std::cerr << "message log " << dir << ": truncate failed\n";
+      return false;
+    }
+
+    uint64_t offset = segment.records_end;
+    segment.records_end += record.size();
+    segment.size = segment.records_end;
+    auto entry = indexEntry(*parse(std::string_view(record).substr(
+                                header_size)),
+                            active, offset, record.size());
+    appendFooterEntry(active_footer, *entry);
+    apply(*entry);
+    return true;
+  }
+
+  std::string sealedFooter(uint64_t records_end, std::string_view entries) {
+    std::string footer = frame(Op::Footer, entries);
+    char trailer[trailer_size];
+    writeU64(trailer, records_end);
+    std::memcpy(trailer + 8, footer_magic, sizeof(footer_magic));
+    footer.append(trailer, sizeof(trailer));
+    return footer;
+  }
+
+  // Seals the active segment and starts the next, with room for at least
+  // one record of `needed` bytes.
+  bool roll(size_t needed) {
+    if (fd >= 0) {
+      Segment &segment = segments[active];
+      std::string footer = sealedFooter(segment.records_end, active_footer);
+      if (!writeAll(fd, footer.data(), footer.size()) || fdatasync(fd) != 0) {
+        std::cerr << "message log " << dir << ": could not seal segment\n";
+        if (ftruncate(fd, segment.records_end) != 0)
+          std::cerr << "message log " << dir << ": truncate failed\n";
+        return false;
+      }
+      segment.size += footer.size();
+      segment.data = map(fd, segment.size);
+      close(fd);
+      fd = -1;
+    }
+
+    uint32_t id = segments.empty() ? 1 : segments.rbegin()->first + 1;
+    int file = ::open(segmentPath(id).c_str(),
+                      O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (file < 0 || !writeAll(file, magic, sizeof(magic))) {
+      std::cerr << "message log " << dir << ": could not start a segment\n";
+      if (file >= 0)
+        close(file);
+      return false;
+    }
+    uint64_t room = std::max<uint64_t>(segment_bytes, sizeof(magic) + needed);
+    segments[id] = {map(file, room), sizeof(magic), sizeof(magic)};
+    active = id;
+    fd = file;
+    capacity = room;
+    active_footer.clear();
+    return true;
+  }
+
+  // Replays a segment from its footer if it has one, otherwise by scanning
+  // its records. A torn or corrupt record ends the scan and is cut off, as
+  // only a crash mid-append should leave one behind. Returns whether the
+  // segment was sealed.
+  bool load(uint32_t id, int file, uint64_t size, std::string &footer) {
+    auto data = map(file, std::max<uint64_t>(size, 1));
+    const char *p = data.get();
+    if (size < sizeof(magic) || std::memcmp(p, magic, sizeof(magic)) != 0) {
+      std::cerr << "message log segment " << segmentPath(id)
+                << " has an unknown format\n";
+      throw std::runtime_error("Failed to open message log");
+    }
+
+    Segment &segment = segments[id];
+    segment.data = data;
+    if (size >= sizeof(magic) + header_size + trailer_size &&
+        std::memcmp(p + size - 8, footer_magic, sizeof(footer_magic)) == 0) {
+      uint64_t at = readU64(p + size - trailer_size);
+      uint64_t payload = at + header_size <= size - trailer_size
+                             ? readU32(p + at)
+                             : 0;
+      if (payload > 0 && at + header_size + payload == size - trailer_size &&
+          crc32(0, reinterpret_cast<const Bytef *>(p + at + header_size),
+                payload) == readU32(p + at + 4) &&
+          p[at + header_size] == static_cast<char>(Op::Footer)) {
+        auto entries = parseFooter(
+            std::string_view(p + at + header_size + 1, payload - 1), id);
+        if (entries) {
+          segment.records_end = at;
+          segment.size = size;
+          for (const IndexEntry &entry : *entries)
+            apply(entry);
+          return true;
+        }
+      }
+    }
+
+    uint64_t pos = sizeof(magic);
+    footer.clear();
+    while (pos + header_size <= size) {
+      uint32_t payload = readU32(p + pos);
+      if (payload > size - pos - header_size)
+        break;
+      const char *start = p + pos + header_size;
+      if (crc32(0, reinterpret_cast<const Bytef *>(start), payload) !=
+          readU32(p + pos + 4))
+        break;
+      auto record = parse({start, payload});
+      auto entry = record ? indexEntry(*record, id, pos, header_size + payload)
+                          : std::nullopt;
+      if (!entry)
+        break;
+      appendFooterEntry(footer, *entry);
+      apply(*entry);
+      pos += header_size + payload;
+    }
+    if (pos < size) {
+      std::cerr << "message log segment " << segmentPath(id) << ": dropping "
+                << size - pos << " bytes after offset " << pos << '\n';
+      if (ftruncate(file, pos) != 0)
+        throw std::runtime_error("Failed to truncate message log");
+    }
+    segment.records_end = pos;
+    segment.size = pos;
+    return false;
+  }
+
+  void recover() {
+    std::error_code ec;
+    // A single-file log from before segments becomes the first segment.
+    std::filesystem::path staging = dir.string() + ".new";
+    if (std::filesystem::is_regular_file(dir, ec)) {
+      std::filesystem::create_directory(staging, ec);
+      std::filesystem::rename(dir, staging / "00000001.seg", ec);
+    }
+    if (!std::filesystem::exists(dir, ec) &&
+        std::filesystem::exists(staging, ec))
+      std::filesystem::rename(staging, dir, ec);
+    std::filesystem::create_directories(dir, ec);
+    if (ec) {
+      std::cerr << "Can't open message log " << dir << ": " << ec.message()
+                << '\n';
+      throw std::runtime_error("Failed to open message log");
+    }
+
+    std::vector<uint32_t> ids;
+    for (const auto &file : std::filesystem::directory_iterator(dir, ec)) {
+      std::string name = file.path().filename().string();
+      if (file.path().extension() == ".tmp")
+        std::filesystem::remove(file.path(), ec);
+      else if (file.path().extension() == ".seg")
+        ids.push_back(std::stoul(name));
+    }
+    std::sort(ids.begin(), ids.end());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+      int file = ::open(segmentPath(ids[i]).c_str(),
+                        O_RDWR | O_APPEND | O_CLOEXEC);
+      struct stat st;
+      if (file < 0 || fstat(file, &st) != 0) {
+        std::cerr << "Can't open message log segment " << segmentPath(ids[i])
+                  << '\n';
+        throw std::runtime_error("Failed to open message log");
+      }
+      std::string footer;
+      bool sealed = load(ids[i], file, st.st_size, footer);
+      Segment &segment = segments[ids[i]];
+      if (!sealed && i + 1 == ids.size()) {
+        capacity = std::max<uint64_t>(segment_bytes, segment.size);
+        segment.data = map(file, capacity);
+        active = ids[i];
+        fd = file;
+        active_footer = std::move(footer);
+        return;
+      }
+      if (!sealed) {
+        std::string sealing = sealedFooter(segment.records_end, footer);
+        if (!writeAll(file, sealing.data(), sealing.size()))
+          throw std::runtime_error("Failed to seal message log segment");
+        segment.size += sealing.size();
+        segment.data = map(file, segment.size);
+      }
+      close(file);
+    }
+    if (!roll(0))
+      throw std::runtime_error("Failed to open message log");
+  }
+
+  // Bytes a rewrite would free. Tombstones must stay while an older segment
+  // may hold a record they cancel, so they only count in the oldest.
+  uint64_t reclaimable(uint32_t id, const Segment &segment) const {
+    uint64_t kept = segment.live;
+    if (id != segments.begin()->first)
+      kept += segment.tombstones;
+    uint64_t records = segment.records_end - sizeof(magic);
+    return records > kept ? records - kept : 0;
+  }
+
+  std::optional<uint32_t> compactionCandidate() {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    for (const auto &[id, segment] : segments) {
+      if (id == active)
+        continue;
+      uint64_t records = segment.records_end - sizeof(magic);
+      uint64_t free = reclaimable(id, segment);
+      if (free > 0 && free * 100 >= records * compact_percent)
+        return id;
+    }
+    return std::nullopt;
+  }
+
+  // Copies the records still needed to a new file and renames it over the
+  // segment, then points the index at the new offsets. The copy runs
+  // without the lock: sealed segments don't change, and records deleted
+  // meanwhile just stay until the next pass.
+  void compact(uint32_t id) {
+    auto started = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration locked{};
+    std::vector<std::pair<uint64_t, uint32_t>> keep;
+    std::shared_ptr<const char[]> data;
+    uint64_t old_size;
+    {
+      auto t = std::chrono::steady_clock::now();
+      std::shared_lock<std::shared_mutex> lock(mtx);
+      const Segment &segment = segments.at(id);
+      data = segment.data;
+      old_size = segment.size;
+      for (const auto &[to, entries] : inboxes)
+        for (const Entry &entry : entries)
+          if (entry.segment == id)
+            keep.emplace_back(entry.offset, entry.size);
+      for (const auto &[name, user] : users)
+        if (user.segment == id)
+          keep.emplace_back(user.offset, user.size);
+      if (id != segments.begin()->first) {
+        const char *p = data.get();
+        uint64_t at = segment.records_end;
+        auto entries = parseFooter(
+            std::string_view(p + at + header_size + 1,
+                             readU32(p + at) - 1),
+            id);
+        for (const IndexEntry &entry : entries.value_or(
+                 std::vector<IndexEntry>{}))
+          if (entry.op != Op::PutUser && entry.op != Op::PutMessage)
+            keep.emplace_back(entry.offset, entry.size);
+      }
+      locked += std::chrono::steady_clock::now() - t;
+    }
+    std::sort(keep.begin(), keep.end());
+
+    std::filesystem::path tmp = segmentPath(id).string() + ".tmp";
+    int file = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+    std::unordered_map<uint64_t, uint64_t> moved;
+    std::string out(magic, sizeof(magic));
+    std::string footer;
+    for (const auto &[offset, size] : keep) {
+      const char *record = data.get() + offset;
+      auto entry = indexEntry(*parse({record + header_size,
+                                      size - header_size}),
+                              id, out.size(), size);
+      moved[offset] = out.size();
+      out.append(record, size);
+      appendFooterEntry(footer, *entry);
+    }
+    uint64_t records_end = out.size();
+    out += sealedFooter(records_end, footer);
+    if (file < 0 || !writeAll(file, out.data(), out.size()) ||
+        fdatasync(file) != 0) {
+      std::cerr << "message log " << dir << ": compaction failed\n";
+      if (file >= 0)
+        close(file);
+      std::error_code ec;
+      std::filesystem::remove(tmp, ec);
+      return;
+    }
+
+    {
+      auto t = std::chrono::steady_clock::now();
+      std::unique_lock<std::shared_mutex> lock(mtx);
+      Segment &segment = segments.at(id);
+      if (records_end == sizeof(magic)) {
+        ::unlink(tmp.c_str());
+        ::unlink(segmentPath(id).c_str());
+        segments.erase(id);
+      } else {
+        std::filesystem::rename(tmp, segmentPath(id));
+        segment.data = map(file, out.size());
+        segment.records_end = records_end;
+        segment.size = out.size();
+        segment.tombstones = 0;
+        for (auto &[to, entries] : inboxes)
+          for (Entry &entry : entries)
+            if (entry.segment == id)
+              entry.offset = moved.at(entry.offset);
+        for (auto &[name, user] : users)
+          if (user.segment == id)
+            user.offset = moved.at(user.offset);
+        if (id != segments.begin()->first)
+          for (const auto &[offset, size] : keep) {
+            Op op = static_cast<Op>(data.get()[offset + header_size]);
+            if (op != Op::PutUser && op != Op::PutMessage)
+              segment.tombstones += size;
+          }
+      }
+      locked += std::chrono::steady_clock::now() - t;
+    }
+    close(file);
+
+    auto us = [](auto d) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+    compactions++;
+    reclaimed_bytes += old_size - std::min<uint64_t>(old_size, out.size());
+    last_compaction_us = us(std::chrono::steady_clock::now() - started);
+    last_compaction_locked_us = us(locked);
+  }
+
+  void compactLoop() {
+    auto interval =
+        std::chrono::milliseconds(envOr("MAIL_DB_LOG_COMPACT_MS", 5000));
+    std::unique_lock<std::mutex> lock(compact_mtx);
+    while (!stopping) {
+      compact_cv.wait_for(lock, interval, [this] { return stopping; });
+      if (stopping)
+        break;
+      lock.unlock();
+      while (auto id = compactionCandidate())
+        compact(*id);
+      lock.lock();
+    }
+  }
+
+  // Record views into the mapped segments, with the mappings they need.
+  struct Slices {
+    std::vector<std::shared_ptr<const char[]>> keepers;
+    std::vector<std::pair<std::string_view, size_t>> records;
+  };
+
+  Slices locate(const std::string &username) {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    Slices slices;
+    auto inbox = inboxes.find(username);
+    if (inbox == inboxes.end())
+      return slices;
+    std::vector<uint32_t> ids;
+    slices.records.reserve(inbox->second.size());
+    for (const Entry &entry : inbox->second) {
+      auto it = std::find(ids.begin(), ids.end(), entry.segment);
+      if (it == ids.end()) {
+        ids.push_back(entry.segment);
+        slices.keepers.push_back(segments.at(entry.segment).data);
+        it = ids.end() - 1;
+      }
+      size_t keeper = it - ids.begin();
+      slices.records.emplace_back(
+          std::string_view(slices.keepers[keeper].get() + entry.offset,
+                           entry.size),
+          keeper);
+    }
+    return slices;
+  }
+
+  static std::optional<Record> message(std::string_view record) {
+    auto parsed = parse(record.substr(header_size));
+    if (!parsed || parsed->op != Op::PutMessage || parsed->count != 6)
+      return std::nullopt;
+    return parsed;
+  }
+
+public:
+  explicit LogDatabase(const std::string &path) : dir(path) {
+    recover();
+    compactor = std::thread([this] { compactLoop(); });
+  }
+
+  ~LogDatabase() override {
+    {
+      std::lock_guard<std::mutex> lock(compact_mtx);
+      stopping = true;
+    }
+    compact_cv.notify_all();
+    compactor.join();
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool createUser(const std::string &username,
+                  const std::string &password) override {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    return !users.count(username) &&
+           append(Op::PutUser, {username, password});
+  }
+
+  std::optional<std::string> getPassword(const std::string &username) override {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    auto it = users.find(username);
+    if (it == users.end())
+      return std::nullopt;
+    return it->second.password;
+  }
+
+  bool setPassword(const std::string &username,
+                   const std::string &password) override {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    return users.count(username) && append(Op::PutUser, {username, password});
+  }
+
+  bool userExists(const std::string &username) override {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    return users.count(username) != 0;
+  }
+
+  std::pmr::vector<std::pmr::string>
+  getUsers(std::pmr::memory_resource *mr) override {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    std::pmr::vector<std::pmr::string> names(mr);
+    names.reserve(users.size());
+    for (const auto &user : users)
+      names.emplace_back(user.first);
+    return names;
+  }
+
+  bool createMessage(const Message &msg) override {
+    std::string created_at = timestamp();
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    return append(Op::PutMessage, {msg.id, msg.from, msg.to, msg.subject,
+                                   created_at, msg.body});
+  }
+
+  Inbox getMessagesForUser(const std::string &username) override {
+    Slices slices = locate(username);
+    Inbox messages;
+    messages.reserve(slices.records.size());
+    for (auto it = slices.records.rbegin(); it != slices.records.rend();
+         ++it) {
+      auto record = message(it->first);
+      if (!record) {
+        std::cerr << "Failed to read a message of " << username << '\n';
+        continue;
+      }
+      const auto &f = record->fields;
+      messages.emplace_back(f[1], f[2], f[3], f[5], f[0],
+                            slices.keepers[it->second]);
+    }
+    return messages;
+  }
+
+  // No index: the inbox is scanned newest first for messages whose subject
+  // or body contains every word of the query, ignoring ASCII case.
+  MessageRows searchMessages(const std::string &username,
+                             const std::string &query, int limit, int offset,
+                             std::pmr::memory_resource *mr) override {
+    MessageRows messages(mr);
+    auto lower = [](std::string text) {
+      for (char &c : text)
+        c = std::tolower(static_cast<unsigned char>(c));
+      return text;
+    };
+    std::vector<std::string> words;
+    std::istringstream input(query);
+    std::string word;
+    while (input >> word)
+      words.push_back(lower(word));
+    if (words.empty())
+      return messages;
+
+    Slices slices = locate(username);
+    for (auto it = slices.records.rbegin();
+         it != slices.records.rend() &&
+         messages.size() < static_cast<size_t>(limit);
+         ++it) {
+      auto record = message(it->first);
+      if (!record)
+        continue;
+      const auto &f = record->fields;
+      std::string text = lower(std::string(f[3]) + '\n' + std::string(f[5]));
+      if (!std::all_of(words.begin(), words.end(), [&](const auto &w) {
+            return text.find(w) != std::string::npos;
+          }))
+        continue;
+      if (offset > 0) {
+        offset--;
+        continue;
+      }
+      MessageRow &m = messages.emplace_back();
+      m.id = f[0];
+      m.from = f[1];
+      m.to = f[2];
+      m.subject = f[3];
+      m.body = f[5];
+    }
+    return messages;
+  }
+
+  bool deleteMessage(const std::string &username,
+                     const std::string &msg_id) override {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    auto inbox = inboxes.find(username);
+    return inbox != inboxes.end() &&
+           std::any_of(inbox->second.begin(), inbox->second.end(),
+                       [&](const Entry &e) { return e.id == msg_id; }) &&
+           append(Op::DeleteMessage, {username, msg_id});
+  }
+
+  bool deleteUser(const std::string &username) override {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    bool existed = users.count(username) != 0;
+    return append(Op::DeleteUser, {username}) && existed;
+  }
+
+  void deleteMessagesOf(const std::string &username) override {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    append(Op::DeleteUser, {username});
+  }
+
+  json bodyStats() override {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    uint64_t stored = 0;
+    uint64_t live = 0;
+    uint64_t free = 0;
+    for (const auto &[id, segment] : segments) {
+      stored += segment.size;
+      live += segment.live;
+      if (id != active)
+        free += reclaimable(id, segment);
+    }
+    return {{"messages", messages},
+            {"logical_bytes", logical_bytes},
+            {"live_bytes", live},
+            {"stored_bytes", stored},
+            {"reclaimable_bytes", free},
+            {"segments", segments.size()},
+            {"compactions", compactions.load()},
+            {"reclaimed_bytes", reclaimed_bytes.load()},
+            {"last_compaction_us", last_compaction_us.load()},
+            {"last_compaction_locked_us", last_compaction_locked_us.load()}};
+  }
+
+  std::vector<std::string> recipients() override {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    std::vector<std::string> names;
+    for (const auto &[to, entries] : inboxes)
+      if (!entries.empty())
+        names.push_back(to);
+    return names;
+  }
+
+  std::optional<std::vector<StoredMessage>>
+  exportInbox(const std::string &username) override {
+    std::vector<StoredMessage> stored;
+    for (const auto &[view, keeper] : locate(username).records) {
+      auto record = message(view);
+      if (!record)
+        return std::nullopt;
+      const auto &f = record->fields;
+      stored.push_back({Message(std::string(f[1]), std::string(f[2]),
+                                std::string(f[3]), std::string(f[5]),
+                                std::string(f[0])),
+                        std::string(f[4])});
+    }
+    return stored;
+  }
+
+  bool importMessages(const std::vector<StoredMessage> &stored) override {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    for (const StoredMessage &message : stored) {
+      const Message &msg = message.msg;
+      const auto &entries = inboxes[msg.to];
+      if (std::any_of(entries.begin(), entries.end(),
+                      [&](const Entry &e) { return e.id == msg.id; }))
+        continue;
+      if (!append(Op::PutMessage, {msg.id, msg.from, msg.to, msg.subject,
+                                   message.created_at, msg.body}))
+        return false;
+    }
+    return true;
+  }
+
+  bool deleteInbox(const std::string &username) override {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    return append(Op::DeleteInbox, {username});
+  }
+};
+
+std::unique_ptr<Database> openDatabase(const std::string &path,
+                                       size_t read_connections) {
+  if (Database::engine() == Database::Engine::Log)
+    return std::make_unique<LogDatabase>(path);
+  return std::make_unique<SqliteDatabase>(path, read_connections);
+}
+
+// Messages are spread over MAIL_DB_SHARDS databases by a hash of the
+// recipient, so an inbox is read, searched and cleared on one shard and sends
+// to different users commit on different writer threads. Shard 0 is
+// messages.db (messages.log with the log engine), which also keeps the users
+// table; the others are messages-1.db and up. Changing the count needs a
+// --rebalance run.
+class MessageShards {
+public:
+  struct Shard {
+    Database &db;
+    Executor &reads;
+    Executor &writes;
+  };
+
+private:
+  Database &primary;
+  Executors &pools;
+  std::vector<std::unique_ptr<Database>> others;
+
+public:
+  MessageShards(Database &primary, Executors &pools)
+      : primary(primary), pools(pools) {
+    for (size_t i = 0; i < pools.shard_reads.size(); i++)
+      others.push_back(
+          openDatabase(path(i + 1), pools.shard_reads[i]->threads()));
+  }
+
+  static std::string path(size_t index) {
+    std::string name =
+        index == 0 ? "messages" : "messages-" + std::to_string(index);
+    bool log = Database::engine() == Database::Engine::Log;
+    return name + (log ? ".log" : ".db");
+  }
+
+  // FNV-1a rather than std::hash: placement is on disk, so it can't depend
+  // on the standard library build.
+  static size_t shardOf(std::string_view username, size_t count) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : username)
+      hash = (hash ^ c) * 0x100000001b3ull;
+    return hash % count;
+  }
+
+  size_t size() const { return others.size() + 1; }
+
+  Shard shard(size_t index) {
+    if (index == 0)
+      return {primary, pools.reads, pools.writes};
+    return {*others[index - 1], *pools.shard_reads[index - 1],
+            *pools.shard_writes[index - 1]};
+  }
+
+  Shard route(std::string_view username) {
+    return shard(shardOf(username, size()));
+  }
+
+  void startCheckpoints() {
+    for (size_t i = 0; i < size(); i++)
+      shard(i).db.startCheckpoints();
+  }
+
+  // A shard counts as idle while nothing is queued on its executors.
+  void startMaintenance() {
+    for (size_t i = 0; i < size(); i++) {
+      Shard s = shard(i);
+      s.db.startMaintenance([&reads = s.reads, &writes = s.writes] {
+        return reads.queued() == 0 && writes.queued() == 0;
+      });
+    }
+  }
+
+  // Sent messages can be on any shard; the user row goes last, as before.
+  bool deleteUser(const std::string &username) {
+    for (size_t i = 1; i < size(); i++) {
+      Shard s = shard(i);
+      s.writes.run([&] { s.db.deleteMessagesOf(username); });
+    }
+    return pools.writes.run([&] { return primary.deleteUser(username); });
+  }
+
+  // Body totals over all shards, and each shard's own. Dictionaries are
+  // trained per shard, so their versions only appear in the latter.
+  json stats() {
+    json totals;
+    json shards = json::array();
+    for (size_t i = 0; i < size(); i++) {
+      Shard s = shard(i);
+      json bodies = s.reads.run([&] { return s.db.bodyStats(); });
+      shards.push_back({{"path", path(i)},
+                        {s.reads.getName(), s.reads.stats()},
+                        {s.writes.getName(), s.writes.stats()},
+                        {"message_bodies", bodies},
+                        {"maintenance", s.reads.run([&] {
+                           return s.db.maintenanceStats();
+                         })}});
+      if (i == 0) {
+        totals = bodies;
+        continue;
+      }
+      for (const auto &[key, value] : bodies.items())
+        if (value.is_number_integer())
+          totals[key] = totals.value(key, int64_t{0}) + value.get<int64_t>();
+    }
+
+    if (size() > 1 && totals.contains("dedup_ratio")) {
+      auto ratio = [&totals](const char *a, const char *b) {
+        int64_t d = totals.value(b, int64_t{0});
+        return d > 0 ? static_cast<double>(totals.value(a, int64_t{0})) / d
+                     : 1.0;
+      };
+      totals["dedup_ratio"] = ratio("logical_bytes", "unique_bytes");
+      totals["compression_ratio"] = ratio("unique_bytes", "stored_bytes");
+      totals.erase("dictionary");
+    }
+    return {{"message_bodies", totals}, {"shards", shards}};
+  }
+};
+
+// Online backups, started by an admin. Each shard is copied into
+// MAIL_BACKUP_DIR/<id>.partial, MAIL_BACKUP_STEP_PAGES pages at a time with
+// MAIL_BACKUP_PAUSE_MS between steps, and a step is held back (for up to
+// max_yields more pauses) while the shard has requests queued. The directory
+// loses its suffix once every shard is copied, so completed snapshots are
+// found on disk by whichever worker is asked to stream one.
+class Backups {
+private:
+  struct Progress {
+    int64_t done = 0;
+    int64_t total = 0;
+  };
+
+  MessageShards &shards;
+  const std::filesystem::path dir;
+  const int step_pages = std::max<int>(envOr("MAIL_BACKUP_STEP_PAGES", 256), 1);
+  const std::chrono::milliseconds pause{envOr("MAIL_BACKUP_PAUSE_MS", 10)};
+  static constexpr int max_yields = 20;
+
+  mutable std::mutex mtx;
+  std::thread job;
+  std::atomic<bool> stopping{false};
+  bool running = false;
+  std::string id;
+  std::string error;
+  std::vector<Progress> progress;
+  uint64_t yields = 0;
+  std::chrono::steady_clock::time_point started;
+  std::chrono::steady_clock::duration elapsed{};
+
+  static std::string newId() {
+    time_t now = time(nullptr);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    char text[32];
+    strftime(text, sizeof(text), "%Y%m%dT%H%M%SZ", &tm);
+    return text;
+  }
+
+  bool pace(MessageShards::Shard s) {
+    std::this_thread::sleep_for(pause);
+    for (int i = 0; i < max_yields && !stopping &&
+                    (s.reads.queued() > 0 || s.writes.queued() > 0);
+         i++) {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        yields++;
+      }
+      std::this_thread::sleep_for(pause);
+    }
+    return !stopping;
+  }
+
+  void run(const std::string &id) {
+    std::error_code ec;
+    std::filesystem::path partial = dir / (id + ".partial");
+    std::string failure;
+    if (!std::filesystem::create_directories(partial, ec))
+      failure = "could not create " + partial.string();
+    for (size_t i = 0; failure.empty() && i < shards.size(); i++) {
+      MessageShards::Shard s = shards.shard(i);
+      std::string name = MessageShards::path(i);
+      bool ok = s.db.backup(
+          (partial / name).string(), step_pages,
+          [this, i, s](int64_t done, int64_t total) {
+            {
+              std::lock_guard<std::mutex> lock(mtx);
+              progress[i] = {done, total};
+            }
+            return pace(s);
+          });
+      if (!ok)
+        failure = stopping ? "stopped" : "could not back up " + name;
+      else {
+        std::lock_guard<std::mutex> lock(mtx);
+        progress[i].done = progress[i].total =
+            std::filesystem::file_size(partial / name, ec);
+      }
+    }
+    if (failure.empty()) {
+      std::filesystem::rename(partial, dir / id, ec);
+      if (ec)
+        failure = "could not rename " + partial.string();
+    }
+    if (!failure.empty())
+      std::filesystem::remove_all(partial, ec);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    running = false;
+    error = failure;
+    elapsed = std::chrono::steady_clock::now() - started;
+  }
+
+public:
+  explicit Backups(MessageShards &shards)
+      : shards(shards), dir([] {
+          const char *dir = std::getenv("MAIL_BACKUP_DIR");
+          return dir ? dir : "backups";
+        }()) {}
+
+  ~Backups() {
+    stopping = true;
+    if (job.joinable())
+      job.join();
+  }
+
+  static bool supported() {
+    return Database::engine() == Database::Engine::Sqlite;
+  }
+
+  // The new backup's id, or nothing while one is already running.
+  std::optional<std::string> start() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (running)
+      return std::nullopt;
+    if (job.joinable())
+      job.join();
+    id = newId();
+    error.clear();
+    progress.assign(shards.size(), {});
+    yields = 0;
+    started = std::chrono::steady_clock::now();
+    running = true;
+    job = std::thread([this, id = id] { run(id); });
+    return id;
+  }
+
+  // Completed snapshots, oldest first.
+  std::vector<std::string> snapshots() const {
+    std::vector<std::string> ids;
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec))
+      if (entry.is_directory(ec) && entry.path().extension() != ".partial")
+        ids.push_back(entry.path().filename().string());
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  }
+
+  std::optional<std::filesystem::path> file(const std::string &id,
+                                            size_t shard) const {
+    auto ids = snapshots();
+    if (shard >= shards.size() ||
+        std::find(ids.begin(), ids.end(), id) == ids.end())
+      return std::nullopt;
+    return dir / id / MessageShards::path(shard);
+  }
+
+  json stats() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto taken =
+        running ? std::chrono::steady_clock::now() - started : elapsed;
+    double seconds = std::chrono::duration<double>(taken).count();
+    int64_t done = 0;
+    int64_t total = 0;
+    json per_shard = json::array();
+    for (const auto &p : progress) {
+      done += p.done;
+      total += p.total;
+      per_shard.push_back({{"bytes_copied", p.done}, {"bytes_total", p.total}});
+    }
+    return {{"running", running},
+            {"id", id},
+            {"error", error},
+            {"bytes_copied", done},
+            {"bytes_total", total},
+            {"elapsed_ms", static_cast<int64_t>(seconds * 1000)},
+            {"mib_per_s", seconds > 0 ? done / seconds / (1 << 20) : 0.0},
+            {"yields", yields},
+            {"shards", per_shard},
+            {"snapshots", snapshots()}};
+  }
+};
+
+// Offline tool, run with the server stopped and MAIL_DB_SHARDS set to the new
+// count. Each inbox found on the wrong shard, including shards past the new
+// count, is copied to where shardOf() places it and then deleted where it
+// was; a run that is interrupted is finished by running it again.
+int rebalanceShards() {
+  size_t count = Executors::dbShards();
+  std::vector<std::unique_ptr<Database>> shards;
+  for (size_t i = 0;
+       i < count || access(MessageShards::path(i).c_str(), F_OK) == 0; i++)
+    shards.push_back(openDatabase(MessageShards::path(i), 1));
+
+  size_t inboxes = 0;
+  size_t messages = 0;
+  for (size_t from = 0; from < shards.size(); from++) {
+    for (const auto &user : shards[from]->recipients()) {
+      size_t to = MessageShards::shardOf(user, count);
+      if (to == from)
+        continue;
+      auto inbox = shards[from]->exportInbox(user);
+      if (!inbox || !shards[to]->importMessages(*inbox) ||
+          !shards[from]->deleteInbox(user)) {
+        std::cerr << "could not move the inbox of " << user << " from "
+                  << MessageShards::path(from) << " to "
+                  << MessageShards::path(to) << '\n';
+        return 1;
+      }
+      inboxes++;
+      messages += inbox->size();
+    }
+  }
+
+  std::cout << "moved " << messages << " messages in " << inboxes
+            << " inboxes; " << count << " shards in use\n";
+  for (size_t i = count; i < shards.size(); i++)
+    std::cout << MessageShards::path(i) << " is now empty and can be removed\n";
+  return 0;
+}
+
+std::string base64url(std::string_view data) {
+  static const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  std::string out;
+  out.reserve((data.size() * 4 + 2) / 3);
+  uint32_t bits = 0;
+  int count = 0;
+  for (unsigned char c : data) {
+    bits = (bits << 8) | c;
+    count += 8;
+    while (count >= 6) {
+      count -= 6;
+      out += digits[(bits >> count) & 0x3f];
+    }
+  }
+  if (count > 0)
+    out += digits[(bits << (6 - count)) & 0x3f];
+  return out;
+}
+
+std::optional<std::string> unbase64url(std::string_view text) {
+  std::string out;
+  out.reserve(text.size() * 3 / 4);
+  uint32_t bits = 0;
+  int count = 0;
+  for (char c : text) {
+    int value;
+    if (c >= 'A' && c <= 'Z')
+      value = c - 'A';
+    else if (c >= 'a' && c <= 'z')
+      value = c - 'a' + 26;
+    else if (c >= '0' && c <= '9')
+      value = c - '0' + 52;
+    else if (c == '-')
+      value = 62;
+    else if (c == '_')
+      value = 63;
+    else
+      return std::nullopt;
+    bits = (bits << 6) | value;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out += static_cast<char>((bits >> count) & 0xff);
+    }
+  }
+  // Only the canonical encoding decodes, so a token has exactly one spelling.
+  if (count >= 6 || (bits & ((1u << count) - 1)) != 0)
+    return std::nullopt;
+  return out;
+}
+
+// HMAC-SHA256 over session token payloads. Each key's inner and outer pad
+// states are hashed once at startup, so a MAC costs two short digest runs on
+// a thread-local context. The first key signs; the others still verify, so
+// keys can be rotated without logging everyone out.
+class TokenSigner {
+public:
+  static constexpr size_t mac_bytes = 16;
+
+  // secrets is a comma-separated list; null or empty disables signing.
+  explicit TokenSigner(const char *secrets) {
+    std::string secret;
+    std::istringstream in(secrets ? secrets : "");
+    while (std::getline(in, secret, ','))
+      if (!secret.empty())
+        keys.push_back(makeKey(secret));
+  }
+
+  TokenSigner(const TokenSigner &) = delete;
+  TokenSigner &operator=(const TokenSigner &) = delete;
+
+  ~TokenSigner() {
+    for (auto &key : keys) {
+      EVP_MD_CTX_free(key.inner);
+      EVP_MD_CTX_free(key.outer);
+    }
+  }
+
+  bool enabled() const { return !keys.empty(); }
+
+  std::string sign(const std::string &claims) const {
+    const Key &key = keys.front();
+    std::string payload = key.id + "|" + claims;
+    return base64url(payload) + "." + base64url(mac(key, payload));
+  }
+
+  // Returns the signed claims, or nothing if the token is malformed, signed
+  // with an unknown key or fails the MAC check.
+  std::optional<std::string> verify(std::string_view token) const {
+    size_t dot = token.find('.');
+    if (dot == std::string_view::npos)
+      return std::nullopt;
+    auto payload = unbase64url(token.substr(0, dot));
+    auto tag = unbase64url(token.substr(dot + 1));
+    if (!payload || !tag || tag->size() != mac_bytes)
+      return std::nullopt;
+    size_t bar = payload->find('|');
+    if (bar == std::string::npos)
+      return std::nullopt;
+    for (const auto &key : keys) {
+      if (payload->compare(0, bar, key.id) != 0)
+        continue;
+      std::string expected = mac(key, *payload);
+      if (CRYPTO_memcmp(expected.data(), tag->data(), mac_bytes) != 0)
+        return std::nullopt;
+      return payload->substr(bar + 1);
+    }
+    return std::nullopt;
+  }
+
+private:
+  struct Key {
+    std::string id;
+    EVP_MD_CTX *inner;
+    EVP_MD_CTX *outer;
+  };
+
+  std::vector<Key> keys;
+
+  static Key makeKey(const std::string &secret) {
+    unsigned char block[64] = {};
+    unsigned char digest[32];
+    unsigned int length;
+    EVP_Digest(secret.data(), secret.size(), digest, &length, EVP_sha256(),
+               nullptr);
+    if (secret.size() > sizeof block)
+      std::memcpy(block, digest, sizeof digest);
+    else
+      std::memcpy(block, secret.data(), secret.size());
+
+    // The key id is a short fingerprint, so tokens name their key without
+    // revealing anything about it.
+    Key key{base64url(std::string_view(reinterpret_cast<char *>(digest), 4)),
+            EVP_MD_CTX_new(), EVP_MD_CTX_new()};
+    unsigned char pad[64];
+    for (size_t i = 0; i < sizeof pad; i++)
+      pad[i] = block[i] ^ 0x36;
+    EVP_DigestInit_ex(key.inner, EVP_sha256(), nullptr);
+    EVP_DigestUpdate(key.inner, pad, sizeof pad);
+    for (size_t i = 0; i < sizeof pad; i++)
+      pad[i] = block[i] ^ 0x5c;
+    EVP_DigestInit_ex(key.outer, EVP_sha256(), nullptr);
+    EVP_DigestUpdate(key.outer, pad, sizeof pad);
+    OPENSSL_cleanse(block, sizeof block);
+    OPENSSL_cleanse(pad, sizeof pad);
+    return key;
+  }
+
+  static std::string mac(const Key &key, std::string_view data) {
+    struct Context {
+      EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+      ~Context() { EVP_MD_CTX_free(ctx); }
+    };
+    thread_local Context context;
+    unsigned char inner[32];
+    unsigned char outer[32];
+    EVP_MD_CTX_copy_ex(context.ctx, key.inner);
+    EVP_DigestUpdate(context.ctx, data.data(), data.size());
+    EVP_DigestFinal_ex(context.ctx, inner, nullptr);
+    EVP_MD_CTX_copy_ex(context.ctx, key.outer);
+    EVP_DigestUpdate(context.ctx, inner, sizeof inner);
+    EVP_DigestFinal_ex(context.ctx, outer, nullptr);
+    return std::string(reinterpret_cast<char *>(outer), mac_bytes);
+  }
+};
+
+// Append-only record of session changes so a restart keeps everyone logged
+// in. Records are buffered and written by one flusher thread in batches;
+// on startup the file is mapped and replayed in place. When the file holds
+// well over twice the records a fresh snapshot would, the flusher replaces
+// it with that snapshot.
+class SessionLog {
+public:
+  enum class Op : char {
+    Add = 'A',
+    Remove = 'R',
+    RemoveUser = 'U',
+    Revoke = 'L'
+  };
+
+  struct Snapshot {
+    std::string records;
+    size_t count = 0;
+    // position() at the time the snapshot was taken; records appended
+    // before it are already reflected in the snapshot.
+    uint64_t position = 0;
+  };
+
+  // op, key length and value length, followed by key and value bytes.
+  static constexpr size_t header_bytes = 5;
+
+  static void encode(std::string &out, Op op, std::string_view key,
+                     std::string_view value) {
+    char header[header_bytes] = {
+        static_cast<char>(op),
+        static_cast<char>(key.size() & 0xff),
+        static_cast<char>(key.size() >> 8),
+        static_cast<char>(value.size() & 0xff),
+        static_cast<char>(value.size() >> 8)};
+    out.append(header, sizeof header);
+    out.append(key);
+    out.append(value);
+  }
+
+  static void encode(Snapshot &snapshot, Op op, std::string_view key,
+                     std::string_view value = {}) {
+    encode(snapshot.records, op, key, value);
+    snapshot.count++;
+  }
+
+  // With several workers each appends to its own base.N file. Worker 0 also
+  // takes over files nobody owns any more (the single-process log, or those
+  // of workers beyond the current count) and folds them into its own with a
+  // compaction right after startup.
+  SessionLog(const std::string &base, size_t worker = 0, size_t workers = 1)
+      : path(workers > 1 && !base.empty()
+                 ? base + "." + std::to_string(worker)
+                 : base) {
+    if (base.empty() || worker != 0)
+      return;
+    std::filesystem::path base_path(base);
+    std::string prefix = base_path.filename().string();
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(
+             base_path.has_parent_path() ? base_path.parent_path() : ".",
+             ec)) {
+      std::string name = entry.path().filename().string();
+      if (name == prefix) {
+        if (workers > 1)
+          inherited.push_back(entry.path().string());
+        continue;
+      }
+      if (name.compare(0, prefix.size() + 1, prefix + ".") != 0)
+        continue;
+      std::string suffix = name.substr(prefix.size() + 1);
+      if (suffix.empty() || suffix.size() > 6 ||
+          suffix.find_first_not_of("0123456789") != std::string::npos)
+        continue;
+      if (workers == 1 || std::stoul(suffix) >= workers)
+        inherited.push_back(entry.path().string());
+    }
+  }
+
+  SessionLog(const SessionLog &) = delete;
+  SessionLog &operator=(const SessionLog &) = delete;
+
+  ~SessionLog() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopping = true;
+    }
+    cv.notify_all();
+    if (flusher.joinable())
+      flusher.join();
+    if (fd >= 0)
+      ::close(fd);
+  }
+
+  bool enabled() const { return !path.empty(); }
+
+  // Calls apply(op, key, value) for each intact record, with views into the
+  // mapped files, and returns how many there were. Inherited files come
+  // first.
+  template <typename Apply> size_t replay(Apply &&apply) {
+    if (!enabled())
+      return 0;
+    size_t count = 0;
+    for (const auto &file : inherited)
+      count += replayFile(file, apply);
+    replayed = replayFile(path, apply);
+    return count + replayed;
+  }
+
+  // Opens the log for appending and starts the flusher. live is the number
+  // of records a snapshot would hold right now; snapshot must take the same
+  // lock its caller holds around append().
+  void start(size_t live, std::function<Snapshot()> snapshot) {
+    if (!enabled())
+      return;
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      std::cerr << "could not open " << path << ", sessions not persisted\n";
+      path.clear();
+      return;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size == 0)
+      writeAll(fd, magic, sizeof magic - 1);
+    file_records = replayed;
+    compacted_records = live;
+    take_snapshot = std::move(snapshot);
+    flusher = std::thread([this] { flushLoop(); });
+  }
+
+  void append(Op op, std::string_view key, std::string_view value = {}) {
+    if (!enabled() || key.size() > 0xffff || value.size() > 0xffff)
+      return;
+    bool full;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      size_t before = pending.size();
+      encode(pending, op, key, value);
+      appended += pending.size() - before;
+      pending_records++;
+      full = pending.size() >= flush_bytes;
+    }
+    if (full)
+      cv.notify_one();
+  }
+
+  uint64_t position() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return appended;
+  }
+
+  json stats() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return {{"enabled", enabled()},
+            {"file_records", file_records},
+            {"pending_bytes", pending.size()},
+            {"batches", batches},
+            {"compactions", compactions},
+            {"write_errors", write_errors}};
+  }
+
+private:
+  static constexpr char magic[] = "MAILSES1";
+
+  std::string path;
+  int fd = -1;
+  const size_t flush_bytes = 64 << 10;
+  const std::chrono::milliseconds flush_interval{
+      envOr("MAIL_SESSION_FLUSH_MS", 100)};
+  const bool sync = envOr("MAIL_SESSION_FSYNC", 0) != 0;
+  const size_t compact_slack = envOr("MAIL_SESSION_COMPACT_RECORDS", 100000);
+
+  mutable std::mutex mtx;
+  std::condition_variable cv;
+  std::thread flusher;
+  bool stopping = false;
+  std::string pending;
+  size_t pending_records = 0;
+  uint64_t appended = 0;
+  // Bytes of appended that are already in the file or were superseded by a
+  // snapshot.
+  uint64_t flushed = 0;
+  size_t replayed = 0;
+  size_t file_records = 0;
+  size_t compacted_records = 0;
+  uint64_t batches = 0;
+  uint64_t compactions = 0;
+  uint64_t write_errors = 0;
+  std::function<Snapshot()> take_snapshot;
+  // Files replayed at startup that the next compaction absorbs and removes.
+  std::vector<std::string> inherited;
+
+  // A torn record at the end (a crash mid-write) is cut off so later
+  // appends line up again.
+  template <typename Apply>
+  size_t replayFile(const std::string &file, Apply &apply) {
+    int in = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+      return 0;
+    struct stat st;
+    size_t size = ::fstat(in, &st) == 0 ? st.st_size : 0;
+    void *mapped = size > 0 ? ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE,
+                                     in, 0)
+                            : MAP_FAILED;
+    ::close(in);
+    if (mapped == MAP_FAILED)
+      return 0;
+    ::madvise(mapped, size, MADV_SEQUENTIAL);
+
+    const char *data = static_cast<const char *>(mapped);
+    if (size < sizeof magic - 1 ||
+        std::memcmp(data, magic, sizeof magic - 1) != 0) {
+      std::cerr << file << " is not a session log, moved aside\n";
+      ::munmap(mapped, size);
+      std::rename(file.c_str(), (file + ".corrupt").c_str());
+      return 0;
+    }
+    size_t pos = sizeof magic - 1;
+    size_t count = 0;
+    while (pos + header_bytes <= size) {
+      size_t key_size = lengthAt(data + pos + 1);
+      size_t value_size = lengthAt(data + pos + 3);
+      if (pos + header_bytes + key_size + value_size > size)
+        break;
+      const char *key = data + pos + header_bytes;
+      apply(static_cast<Op>(data[pos]), std::string_view(key, key_size),
+            std::string_view(key + key_size, value_size));
+      pos += header_bytes + key_size + value_size;
+      count++;
+    }
+    ::munmap(mapped, size);
+    if (pos < size && ::truncate(file.c_str(), pos) != 0)
+      std::cerr << "could not truncate " << file << '\n';
+    return count;
+  }
+
+  static size_t lengthAt(const char *p) {
+    return static_cast<unsigned char>(p[0]) |
+           static_cast<size_t>(static_cast<unsigned char>(p[1])) << 8;
+  }
+
+  static size_t recordSize(const char *record) {
+    return header_bytes + lengthAt(record + 1) + lengthAt(record + 3);
+  }
+
+  void flushLoop() {
+    std::unique_lock<std::mutex> lock(mtx);
+    for (;;) {
+      cv.wait_for(lock, flush_interval, [this] {
+        return stopping || pending.size() >= flush_bytes;
+      });
+      if (!inherited.empty() ||
+          file_records + pending_records >=
+              2 * compacted_records + compact_slack) {
+        lock.unlock();
+        compact();
+        lock.lock();
+      }
+      if (!pending.empty()) {
+        std::string batch;
+        batch.swap(pending);
+        size_t records = pending_records;
+        pending_records = 0;
+        flushed = appended;
+        lock.unlock();
+        bool ok = writeAll(fd, batch.data(), batch.size()) &&
+                  (!sync || ::fdatasync(fd) == 0);
+        lock.lock();
+        batches++;
+        file_records += records;
+        if (!ok)
+          write_errors++;
+      }
+      if (stopping && pending.empty())
+        return;
+    }
+  }
+
+  // Writes a snapshot to a temporary file and renames it over the log.
+  // Pending records the snapshot already covers are dropped; later ones are
+  // flushed to the new file as usual.
+  void compact() {
+    Snapshot snapshot = take_snapshot();
+    std::string temp = path + ".tmp";
+    int out = ::open(temp.c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    bool ok = out >= 0 && writeAll(out, magic, sizeof magic - 1) &&
+              writeAll(out, snapshot.records.data(),
+                       snapshot.records.size()) &&
+              ::fsync(out) == 0 && ::rename(temp.c_str(), path.c_str()) == 0;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (ok)
+      for (const auto &file : inherited)
+        ::unlink(file.c_str());
+    inherited.clear();
+    if (!ok) {
+      if (out >= 0)
+        ::close(out);
+      write_errors++;
+      // Don't retry until the log has grown by another round of slack.
+      compacted_records = file_records;
+      return;
+    }
+    ::close(fd);
+    fd = out;
+    if (snapshot.position > flushed) {
+      size_t covered = snapshot.position - flushed;
+      for (size_t pos = 0; pos < covered; pending_records--)
+        pos += recordSize(pending.data() + pos);
+      pending.erase(0, covered);
+      flushed = snapshot.position;
+    }
+    file_records = snapshot.count;
+    compacted_records = snapshot.count;
+    compactions++;
+  }
+};
+
+int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// Revocation state for signed session tokens: per-user epochs (a token
+// issued at or before its user's epoch is dead), and two bloom filter
+// generations of logged-out tokens, each covering one TTL so a token revoked
+// in the older one has expired by the time it is cleared. It is all atomics
+// in AtomicArrays, so with MAIL_WORKERS > 1 the table is made before forking
+// and a revocation in any worker holds in all of them.
+//
+// Epochs sit in an open-addressed table keyed by a 64-bit fingerprint of the
+// name, so two users share an epoch only if their fingerprints collide.
+// Slots are claimed for good, and when a user's probe window is full their
+// epoch goes to a single overflow epoch that every full window is checked
+// against. Both cases can end sessions early but never keep a revoked one.
+class RevocationTable {
+private:
+  static constexpr size_t max_probes = 32;
+  static constexpr int bloom_hashes = 4;
+
+  const bool is_shared;
+  const int64_t ttl_ms = envOr("MAIL_SESSION_TTL", 7 * 24 * 3600) * 1000;
+  const size_t bloom_bits = std::max<size_t>(
+      envOr("MAIL_SESSION_REVOKE_BITS", size_t(1) << 20), 64);
+  const size_t epoch_slots = std::max<size_t>(
+      envOr("MAIL_SESSION_EPOCH_SLOTS", size_t(1) << 16), max_probes);
+  AtomicArray<std::atomic<uint64_t>> fingerprints;
+  AtomicArray<std::atomic<int64_t>> epochs;
+  AtomicArray<std::atomic<int64_t>> overflow_epoch;
+  // Slots claimed, epochs raised into the overflow, and checks against it.
+  AtomicArray<std::atomic<uint64_t>> counters;
+  AtomicArray<std::atomic<uint64_t>> blooms[2];
+  // The generation being written and when it started.
+  AtomicArray<std::atomic<int64_t>> rotation;
+  inline static std::atomic<int64_t> no_epoch{0};
+
+  // FNV-1a, so it is independent of the std::hash that picks the slot.
+  // Zero marks a free slot.
+  static uint64_t fingerprint(const std::string &username) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : username)
+      hash = (hash ^ c) * 0x100000001b3ull;
+    return hash != 0 ? hash : 1;
+  }
+
+  // The user's slot, claiming the first free one in the window if claim is
+  // set. Slots are never freed, so a free slot ends the search: the user
+  // would have been put there, and has no epoch. Null means the window is
+  // full.
+  std::atomic<int64_t> *slot(const std::string &username, bool claim) const {
+    uint64_t print = fingerprint(username);
+    size_t start = std::hash<std::string>{}(username) % epoch_slots;
+    for (size_t i = 0; i < max_probes; i++) {
+      size_t index = (start + i) % epoch_slots;
+      uint64_t seen = fingerprints[index].load();
+      if (seen == 0) {
+        if (!claim)
+          return &no_epoch;
+        if (fingerprints[index].compare_exchange_strong(seen, print)) {
+          counters[0].fetch_add(1, std::memory_order_relaxed);
+          return &epochs[index];
+        }
+      }
+      if (seen == print)
+        return &epochs[index];
+    }
+    return nullptr;
+  }
+
+  std::array<size_t, bloom_hashes> bloomIndexes(std::string_view token) const {
+    uint64_t h1 = std::hash<std::string_view>{}(token);
+    uint64_t h2 = (h1 >> 33 | h1 << 31) * 0x9e3779b97f4a7c15ull | 1;
+    std::array<size_t, bloom_hashes> indexes;
+    for (int i = 0; i < bloom_hashes; i++)
+      indexes[i] = (h1 + i * h2) % bloom_bits;
+    return indexes;
+  }
+
+  bool bloomContains(int generation, std::string_view token) const {
+    for (size_t index : bloomIndexes(token))
+      if (!(blooms[generation][index / 64].load(std::memory_order_relaxed) &
+            (uint64_t(1) << (index % 64))))
+        return false;
+    return true;
+  }
+
+  // Whichever process wins the swap of the start time clears the older
+  // generation and makes it current.
+  void maybeRotate() {
+    int64_t now = nowMs();
+    int64_t started = rotation[1].load();
+    if (now - started < ttl_ms ||
+        !rotation[1].compare_exchange_strong(started, now))
+      return;
+    int older = 1 - static_cast<int>(rotation[0].load());
+    for (size_t i = 0; i < blooms[older].size(); i++)
+      blooms[older][i].store(0, std::memory_order_relaxed);
+    rotation[0] = older;
+  }
+
+public:
+  explicit RevocationTable(bool shared)
+      : is_shared(shared), fingerprints(epoch_slots, shared),
+        epochs(epoch_slots, shared), overflow_epoch(1, shared),
+        counters(3, shared),
+        blooms{{bloom_bits / 64 + 1, shared}, {bloom_bits / 64 + 1, shared}},
+        rotation(2, shared) {
+    rotation[1] = nowMs();
+  }
+
+  bool shared() const { return is_shared; }
+  int64_t ttl() const { return ttl_ms; }
+
+  int64_t userEpoch(const std::string &username) const {
+    if (auto *epoch = slot(username, false))
+      return epoch->load();
+    counters[2].fetch_add(1, std::memory_order_relaxed);
+    return overflow_epoch[0].load();
+  }
+
+  // Moves the user's epoch forward to at least at and returns it.
+  int64_t raiseUserEpoch(const std::string &username, int64_t at) {
+    auto *epoch = slot(username, true);
+    if (!epoch) {
+      std::cerr << "revocation table full, " << username
+                << " shares the overflow epoch\n";
+      counters[1].fetch_add(1, std::memory_order_relaxed);
+      epoch = &overflow_epoch[0];
+    }
+    int64_t seen = epoch->load();
+    while (seen < at && !epoch->compare_exchange_weak(seen, at)) {
+    }
+    return std::max(seen, at);
+  }
+
+  bool revoked(std::string_view token) const {
+    return bloomContains(0, token) || bloomContains(1, token);
+  }
+
+  void revoke(std::string_view token) {
+    maybeRotate();
+    auto &bloom = blooms[rotation[0].load()];
+    for (size_t index : bloomIndexes(token))
+      bloom[index / 64].fetch_or(uint64_t(1) << (index % 64));
+  }
+
+  json stats() const {
+    return {{"epoch_slots", epoch_slots},
+            {"epoch_slots_used", counters[0].load()},
+            {"overflow_raises", counters[1].load()},
+            {"overflow_checks", counters[2].load()},
+            {"guarantee", "users share an epoch only on a 64-bit fingerprint "
+                          "collision or a full probe window; either can end "
+                          "sessions early, never keep a revoked one"}};
+  }
+};
+
+// Sessions are either random tokens kept in an in-process map, or, when
+// MAIL_SESSION_KEYS is set, signed tokens carrying the user, role and expiry
+// that any process holding the key can check without shared state. Signed
+// tokens are revoked through a RevocationTable, which is lock-free to read
+// and where a false positive only ends a session early. Every change goes
+// to a SessionLog, which is replayed on startup. With a shared table
+// (MAIL_WORKERS > 1) only signed tokens are issued, since the map is local
+// to one worker.
+class SessionStore {
+private:
+  // Map-mode tokens are 32 random bytes sent as hex. Keying on the raw bytes
+  // saves a heap string per session, and any word of a key is already a
+  // uniform hash.
+  using TokenKey = std::array<char, 32>;
+  struct TokenKeyHash {
+    size_t operator()(const TokenKey &key) const {
+      size_t hash;
+      std::memcpy(&hash, key.data(), sizeof hash);
+      return hash;
+    }
+  };
+
+  std::unordered_map<TokenKey, std::string, TokenKeyHash> sessions;
+  mutable std::shared_mutex mtx;
+
+  TokenSigner signer{std::getenv("MAIL_SESSION_KEYS")};
+  RevocationTable &revocations;
+  const int64_t ttl_ms = revocations.ttl();
+
+  // Only kept so log snapshots can carry them; checks go through the
+  // revocation table.
+  std::unordered_map<std::string, int64_t> deleted_users;
+  std::vector<std::pair<std::string, int64_t>> revoked_tokens;
+
+  mutable std::atomic<uint64_t> signed_accepted{0};
+  mutable std::atomic<uint64_t> signed_rejected{0};
+  std::atomic<uint64_t> revoked{0};
+
+  // Declared last so its flusher is stopped before the state it snapshots
+  // is destroyed.
+  SessionLog log;
+
+  struct Claims {
+    std::string username;
+    std::string role;
+    int64_t issued_ms = 0;
+    int64_t expires_ms = 0;
+  };
+
+  static std::optional<Claims> parseClaims(const std::string &text) {
+    std::array<std::string, 4> fields;
+    size_t pos = 0;
+    for (auto &field : fields) {
+      size_t bar = text.find('|', pos);
+      if (bar == std::string::npos)
+        return std::nullopt;
+      field = text.substr(pos, bar - pos);
+      pos = bar + 1;
+    }
+    if (fields[0] != "1")
+      return std::nullopt;
+    Claims claims;
+    try {
+      claims.role = fields[1];
+      claims.issued_ms = std::stoll(fields[2]);
+      claims.expires_ms = std::stoll(fields[3]);
+    } catch (const std::exception &) {
+      return std::nullopt;
+    }
+    claims.username = text.substr(pos);
+    return claims;
+  }
+
+  static std::optional<TokenKey> tokenKey(std::string_view token) {
+    auto digit = [](char c) {
+      return c >= '0' && c <= '9'   ? c - '0'
+             : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                    : -1;
+    };
+    TokenKey key;
+    if (token.size() != key.size() * 2)
+      return std::nullopt;
+    for (size_t i = 0; i < key.size(); i++) {
+      int high = digit(token[2 * i]);
+      int low = digit(token[2 * i + 1]);
+      if (high < 0 || low < 0)
+        return std::nullopt;
+      key[i] = static_cast<char>(high << 4 | low);
+    }
+    return key;
+  }
+
+  static std::optional<TokenKey> rawKey(std::string_view bytes) {
+    TokenKey key;
+    if (bytes.size() != key.size())
+      return std::nullopt;
+    std::memcpy(key.data(), bytes.data(), key.size());
+    return key;
+  }
+
+  // Two passes over the log: the first finds where each user was last
+  // deleted, so the second can skip their earlier sessions instead of
+  // sweeping the map at every deletion.
+  void load() {
+    std::unordered_map<std::string, size_t> deleted_at;
+    size_t index = 0;
+    size_t records = log.replay([&](SessionLog::Op op, std::string_view key,
+                                    std::string_view) {
+      if (op == SessionLog::Op::RemoveUser)
+        deleted_at[std::string(key)] = index;
+      index++;
+    });
+    if (records == 0)
+      return;
+
+    int64_t now = nowMs();
+    sessions.reserve(records);
+    index = 0;
+    log.replay([&](SessionLog::Op op, std::string_view key,
+                   std::string_view value) {
+      switch (op) {
+      case SessionLog::Op::Add: {
+        // A worker can't honour map sessions another worker would not know.
+        auto token = rawKey(key);
+        if (!token || revocations.shared())
+          break;
+        std::string username(value);
+        if (!deleted_at.empty()) {
+          auto deleted = deleted_at.find(username);
+          if (deleted != deleted_at.end() && deleted->second > index)
+            break;
+        }
+        sessions[*token] = std::move(username);
+        break;
+      }
+      case SessionLog::Op::Remove:
+        if (auto token = rawKey(key))
+          sessions.erase(*token);
+        break;
+      case SessionLog::Op::RemoveUser: {
+        int64_t epoch = std::strtoll(std::string(value).c_str(), nullptr, 10);
+        if (epoch <= now - ttl_ms)
+          break;
+        std::string username(key);
+        revocations.raiseUserEpoch(username, epoch);
+        auto &latest = deleted_users[username];
+        latest = std::max(latest, epoch);
+        break;
+      }
+      case SessionLog::Op::Revoke: {
+        std::string token(key);
+        auto text = signer.verify(token);
+        auto claims = text ? parseClaims(*text) : std::nullopt;
+        if (claims && claims->expires_ms > now) {
+          revocations.revoke(token);
+          revoked_tokens.emplace_back(std::move(token), claims->expires_ms);
+        }
+        break;
+      }
+      }
+      index++;
+    });
+  }
+
+  // Deletions go first so that replaying the snapshot can't drop sessions
+  // made after them.
+  SessionLog::Snapshot snapshot() {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    int64_t horizon = nowMs() - ttl_ms;
+    SessionLog::Snapshot out;
+    out.position = log.position();
+    for (auto it = deleted_users.begin(); it != deleted_users.end();) {
+      if (it->second <= horizon) {
+        it = deleted_users.erase(it);
+        continue;
+      }
+      SessionLog::encode(out, SessionLog::Op::RemoveUser, it->first,
+                         std::to_string(it->second));
+      ++it;
+    }
+    revoked_tokens.erase(std::remove_if(revoked_tokens.begin(),
+                                        revoked_tokens.end(),
+                                        [&](const auto &revoked) {
+                                          return revoked.second <=
+                                                 horizon + ttl_ms;
+                                        }),
+                         revoked_tokens.end());
+    for (const auto &revoked : revoked_tokens)
+      SessionLog::encode(out, SessionLog::Op::Revoke, revoked.first);
+    out.records.reserve(out.records.size() + sessions.size() * 48);
+    for (const auto &[token, username] : sessions)
+      SessionLog::encode(out, SessionLog::Op::Add,
+                         std::string_view(token.data(), token.size()),
+                         username);
+    return out;
+  }
+
+  size_t liveRecords() const {
+    return sessions.size() + deleted_users.size() + revoked_tokens.size();
+  }
+
+  std::optional<Claims> verifySigned(const std::string &token) const {
+    auto text = signer.verify(token);
+    auto claims = text ? parseClaims(*text) : std::nullopt;
+    if (!claims || claims->expires_ms <= nowMs() ||
+        claims->issued_ms <= revocations.userEpoch(claims->username) ||
+        revocations.revoked(token)) {
+      signed_rejected.fetch_add(1, std::memory_order_relaxed);
+      return std::nullopt;
+    }
+    signed_accepted.fetch_add(1, std::memory_order_relaxed);
+    return claims;
+  }
+
+public:
+  // An empty log_path keeps sessions in memory only.
+  SessionStore(RevocationTable &revocations, const std::string &log_path,
+               size_t worker = 0, size_t workers = 1)
+      : revocations(revocations), log(log_path, worker, workers) {
+    load();
+    log.start(liveRecords(), [this] { return snapshot(); });
+  }
+
+  std::string issue(const std::string &username) {
+    if (!signer.enabled()) {
+      std::string token = generateToken();
+      add(token, username);
+      return token;
+    }
+    // Issue times are strictly after any epoch set for this user, even
+    // within the same millisecond.
+    int64_t issued = std::max(nowMs(), revocations.userEpoch(username) + 1);
+    return signer.sign("1|" +
+                       std::string(username == "admin" ? "admin" : "user") +
+                       "|" + std::to_string(issued) + "|" +
+                       std::to_string(issued + ttl_ms) + "|" + username);
+  }
+
+  void add(const std::string &token, const std::string &username) {
+    auto key = tokenKey(token);
+    if (!key)
+      throw std::invalid_argument("session tokens are 64 hex digits");
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    sessions[*key] = username;
+    log.append(SessionLog::Op::Add, std::string_view(key->data(), key->size()),
+               username);
+  }
+
+  std::optional<std::string> find(const std::string &token) const {
+    if (signer.enabled() && token.find('.') != std::string::npos) {
+      auto claims = verifySigned(token);
+      if (!claims)
+        return std::nullopt;
+      return claims->username;
+    }
+    auto key = tokenKey(token);
+    if (!key)
+      return std::nullopt;
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    auto it = sessions.find(*key);
+    if (it == sessions.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  bool remove(const std::string &token) {
+    if (signer.enabled() && token.find('.') != std::string::npos) {
+      auto claims = verifySigned(token);
+      if (!claims)
+        return false;
+      revocations.revoke(token);
+      revoked++;
+      std::unique_lock<std::shared_mutex> lock(mtx);
+      revoked_tokens.emplace_back(token, claims->expires_ms);
+      log.append(SessionLog::Op::Revoke, token);
+      return true;
+    }
+    auto key = tokenKey(token);
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    if (!key || sessions.erase(*key) == 0)
+      return false;
+    log.append(SessionLog::Op::Remove,
+               std::string_view(key->data(), key->size()));
+    return true;
+  }
+
+  void removeUser(const std::string &username) {
+    int64_t epoch = revocations.raiseUserEpoch(username, nowMs());
+
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    auto &latest = deleted_users[username];
+    latest = std::max(latest, epoch);
+    log.append(SessionLog::Op::RemoveUser, username, std::to_string(latest));
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      if (it->second == username)
+        it = sessions.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  json stats() const {
+    size_t stored;
+    {
+      std::shared_lock<std::shared_mutex> lock(mtx);
+      stored = sessions.size();
+    }
+    return {{"mode", signer.enabled() ? "signed" : "map"},
+            {"map_sessions", stored},
+            {"signed_accepted", signed_accepted.load()},
+            {"signed_rejected", signed_rejected.load()},
+            {"revoked_tokens", revoked.load()},
+            {"revocation", revocations.stats()},
+            {"log", log.stats()}};
+  }
+};
+
+// Token bucket packed into one atomic word so concurrent requests can take
+// tokens with a single CAS: the high 38 bits hold the refill clock in
+// milliseconds, the low 26 bits hold milli-tokens.
+class TokenBucket {
+private:
+  static constexpr int token_bits = 26;
+  static constexpr uint64_t token_mask = (uint64_t(1) << token_bits) - 1;
+
+  std::atomic<uint64_t> state;
+
+public:
+  std::atomic<uint64_t> last_used_ms;
+
+  TokenBucket(uint64_t now_ms, uint64_t capacity_milli)
+      : state((now_ms << token_bits) | capacity_milli), last_used_ms(now_ms) {}
+
+  bool take(uint64_t now_ms, uint64_t capacity_milli, uint64_t rate_milli) {
+    last_used_ms.store(now_ms, std::memory_order_relaxed);
+    uint64_t current = state.load(std::memory_order_relaxed);
+    for (;;) {
+      uint64_t refilled_at = current >> token_bits;
+      uint64_t tokens = current & token_mask;
+      if (now_ms > refilled_at && rate_milli > 0) {
+        uint64_t added = (now_ms - refilled_at) * rate_milli / 1000;
+        if (tokens + added >= capacity_milli) {
+          tokens = capacity_milli;
+          refilled_at = now_ms;
+        } else {
+          // Only advance the clock by the time actually converted into
+          // tokens, or slow rates would never accumulate a whole token.
+          tokens += added;
+          refilled_at += added * 1000 / rate_milli;
+        }
+      }
+      if (tokens < 1000)
+        return false;
+      uint64_t next = (refilled_at << token_bits) | (tokens - 1000);
+      if (state.compare_exchange_weak(current, next, std::memory_order_acq_rel,
+                                      std::memory_order_relaxed))
+        return true;
+    }
+  }
+};
+
+// Keyed token buckets spread over shards. Lookups take a shard's shared
+// lock and the bucket update itself is lock-free; only first sight of a key
+// takes the exclusive lock, and a full shard evicts the least recently used
+// of a few sampled buckets.
+class RateLimiter {
+private:
+  static constexpr size_t shard_count = 16;
+  static constexpr size_t eviction_samples = 8;
+
+  struct Shard {
+    std::shared_mutex mtx;
+    std::unordered_map<std::string, std::unique_ptr<TokenBucket>> buckets;
+    uint64_t eviction_cursor = 0;
+  };
+
+  std::string name;
+  uint64_t capacity_milli;
+  uint64_t rate_milli;
+  size_t max_per_shard;
+  std::array<Shard, shard_count> shards;
+  std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+  std::atomic<uint64_t> allowed{0};
+  std::atomic<uint64_t> limited{0};
+  std::atomic<uint64_t> evictions{0};
+
+  uint64_t nowMs() const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - epoch)
+        .count();
+  }
+
+  // Each eviction samples from a different spot. Starting from one derived
+  // from the clock made every eviction in the same millisecond drain the
+  // same run of buckets, and the next ones scan the growing empty stretch.
+  void evictOne(Shard &shard) {
+    auto &buckets = shard.buckets;
+    size_t start = (shard.eviction_cursor++ * 0x9e3779b97f4a7c15ull >> 16) %
+                   buckets.bucket_count();
+    auto victim = buckets.end();
+    uint64_t oldest = UINT64_MAX;
+    size_t sampled = 0;
+    for (size_t b = 0; b < buckets.bucket_count() && sampled < eviction_samples;
+         b++) {
+      size_t index = (start + b) % buckets.bucket_count();
+      for (auto it = buckets.begin(index);
+           it != buckets.end(index) && sampled < eviction_samples;
+           ++it, ++sampled) {
+        uint64_t used = it->second->last_used_ms.load(std::memory_order_relaxed);
+        if (used < oldest) {
+          oldest = used;
+          victim = buckets.find(it->first);
+        }
+      }
+    }
+    if (victim != buckets.end()) {
+      buckets.erase(victim);
+      evictions++;
+    }
+  }
+
+public:
+  RateLimiter(std::string name, double burst, double per_second,
+              size_t max_keys = 65536)
+      : name(std::move(name)),
+        capacity_milli(std::min<uint64_t>(burst * 1000, (1 << 26) - 1)),
+        rate_milli(per_second * 1000),
+        max_per_shard(std::max<size_t>(1, max_keys / shard_count)) {}
+
+  bool allow(const std::string &key) {
+    Shard &shard = shards[std::hash<std::string>{}(key) % shard_count];
+    uint64_t now = nowMs();
+    bool ok;
+    {
+      std::shared_lock<std::shared_mutex> lock(shard.mtx);
+      auto it = shard.buckets.find(key);
+      if (it != shard.buckets.end()) {
+        ok = it->second->take(now, capacity_milli, rate_milli);
+        (ok ? allowed : limited)++;
+        return ok;
+      }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(shard.mtx);
+    auto it = shard.buckets.find(key);
+    if (it == shard.buckets.end()) {
+      if (shard.buckets.size() >= max_per_shard)
+        evictOne(shard);
+      it = shard.buckets
+               .emplace(key, std::make_unique<TokenBucket>(now, capacity_milli))
+               .first;
+    }
+    ok = it->second->take(now, capacity_milli, rate_milli);
+    (ok ? allowed : limited)++;
+    return ok;
+  }
+
+  uint64_t retryAfterSeconds() const {
+    return rate_milli == 0 ? 60 : std::max<uint64_t>(1, 1000 / rate_milli);
+  }
+
+  json stats() {
+    size_t keys = 0;
+    for (auto &shard : shards) {
+      std::shared_lock<std::shared_mutex> lock(shard.mtx);
+      keys += shard.buckets.size();
+    }
+    return {{"keys", keys},
+            {"allowed", allowed.load()},
+            {"limited", limited.load()},
+            {"evictions", evictions.load()}};
+  }
+
+  const std::string &getName() const { return name; }
+};
+
+enum class RateKey { RemoteAddr, SessionUser };
+
+struct RateRule {
+  std::string path;
+  RateKey key;
+  RateLimiter *limiter;
+};
+
+// scrypt password hashes, stored as "scrypt$log2(N)$r$p$salt$hash" with hex
+// salt and hash. Rows that predate hashing hold the plaintext; they still
+// verify, and verify() hands back a fresh hash so login can upgrade them,
+// as it does for hashes made with older parameters.
+class PasswordHasher {
+public:
+  struct Check {
+    bool ok = false;
+    std::optional<std::string> rehash;
+  };
+
+  std::string hash(const std::string &password) const {
+    unsigned char salt[16];
+    if (RAND_bytes(salt, sizeof salt) != 1)
+      throw std::runtime_error("RAND_bytes failed");
+    std::string salt_hex = toHex(salt, sizeof salt);
+    auto key = derive(password, salt_hex, log_n, r, p);
+    if (!key)
+      throw std::runtime_error("scrypt failed");
+    return "scrypt$" + std::to_string(log_n) + "$" + std::to_string(r) + "$" +
+           std::to_string(p) + "$" + salt_hex + "$" + *key;
+  }
+
+  Check verify(const std::string &password, const std::string &stored) const {
+    Check check;
+    auto fields = split(stored);
+    if (fields.size() != 6 || fields[0] != "scrypt") {
+      check.ok = equal(password, stored);
+    } else {
+      uint64_t stored_log_n, stored_r, stored_p;
+      try {
+        stored_log_n = std::stoul(fields[1]);
+        stored_r = std::stoul(fields[2]);
+        stored_p = std::stoul(fields[3]);
+      } catch (const std::exception &) {
+        return check;
+      }
+      auto key = derive(password, fields[4], stored_log_n, stored_r, stored_p);
+      check.ok = key && equal(*key, fields[5]);
+      if (stored_log_n == log_n && stored_r == r && stored_p == p)
+        return check;
+    }
+    if (check.ok)
+      check.rehash = hash(password);
+    return check;
+  }
+
+  json stats() const { return {{"log_n", log_n}, {"r", r}, {"p", p}}; }
+
+private:
+  uint64_t log_n = envOr("MAIL_SCRYPT_LOG_N", 14);
+  uint64_t r = envOr("MAIL_SCRYPT_R", 8);
+  uint64_t p = envOr("MAIL_SCRYPT_P", 1);
+
+  static std::optional<std::string> derive(const std::string &password,
+                                           const std::string &salt,
+                                           uint64_t log_n, uint64_t r,
+                                           uint64_t p) {
+    if (log_n < 1 || log_n > 22 || r == 0 || p == 0 || r * p >= (1u << 30))
+      return std::nullopt;
+    uint64_t n = uint64_t(1) << log_n;
+    unsigned char key[32];
+    if (EVP_PBE_scrypt(password.data(), password.size(),
+                       reinterpret_cast<const unsigned char *>(salt.data()),
+                       salt.size(), n, r, p, 128 * r * (n + p + 2), key,
+                       sizeof key) != 1)
+      return std::nullopt;
+    return toHex(key, sizeof key);
+  }
+
+  static std::vector<std::string> split(const std::string &stored) {
+    std::vector<std::string> fields;
+    std::string field;
+    std::istringstream in(stored);
+    while (std::getline(in, field, '$'))
+      fields.push_back(field);
+    return fields;
+  }
+
+  static bool equal(const std::string &a, const std::string &b) {
+    return a.size() == b.size() &&
+           CRYPTO_memcmp(a.data(), b.data(), a.size()) == 0;
+  }
+};
+
+enum class Encoding { Identity, Gzip, Brotli, Zstd };
+
+struct CompressionConfig {
+  size_t min_bytes = envOr("MAIL_COMPRESS_MIN_BYTES", 1024);
+  int gzip_level = envOr("MAIL_GZIP_LEVEL", 6);
+  int brotli_level = envOr("MAIL_BROTLI_LEVEL", 5);
+  int zstd_level = envOr("MAIL_ZSTD_LEVEL", 3);
+};
+
+const char *encodingName(Encoding encoding) {
+  switch (encoding) {
+  case Encoding::Gzip:
+    return "gzip";
+  case Encoding::Brotli:
+    return "br";
+  case Encoding::Zstd:
+    return "zstd";
+  case Encoding::Identity:
+    break;
+  }
+  return "identity";
+}
+
+bool encodingSupported(Encoding encoding) {
+  switch (encoding) {
+  case Encoding::Gzip:
+    return true;
+  case Encoding::Brotli:
+#ifdef MAIL_BROTLI_SUPPORT
+    return true;
+#else
+    return false;
+#endif
+  case Encoding::Zstd:
+#ifdef MAIL_ZSTD_SUPPORT
+    return true;
+#else
+    return false;
+#endif
+  case Encoding::Identity:
+    break;
+  }
+  return false;
+}
+
+bool compressible(const std::string &content_type) {
+  return content_type.rfind("text/", 0) == 0 ||
+         content_type.rfind("application/json", 0) == 0 ||
+         content_type.rfind("application/javascript", 0) == 0 ||
+         content_type.rfind("application/cbor", 0) == 0 ||
+         content_type.rfind("application/msgpack", 0) == 0 ||
+         content_type.rfind("image/svg+xml", 0) == 0;
+}
+
+// Parses an Accept-style header into lower-cased items and their q-values.
+std::map<std::string, double> parseQualityList(const std::string &header) {
+  std::map<std::string, double> items;
+  size_t pos = 0;
+  while (pos < header.size()) {
+    size_t end = header.find(',', pos);
+    if (end == std::string::npos)
+      end = header.size();
+    std::string item = header.substr(pos, end - pos);
+    pos = end + 1;
+
+    double q = 1;
+    size_t semi = item.find(';');
+    if (semi != std::string::npos) {
+      size_t qpos = item.find("q=", semi);
+      if (qpos != std::string::npos)
+        q = std::atof(item.c_str() + qpos + 2);
+      item.erase(semi);
+    }
+    item.erase(0, item.find_first_not_of(" \t"));
+    item.erase(item.find_last_not_of(" \t") + 1);
+    std::transform(item.begin(), item.end(), item.begin(), ::tolower);
+    if (!item.empty())
+      items[item] = q;
+  }
+  return items;
+}
+
+// Picks the supported coding with the highest q-value, preferring br, then
+// zstd, then gzip on ties.
+Encoding negotiateEncoding(const std::string &accept_encoding) {
+  const Encoding preference[] = {Encoding::Brotli, Encoding::Zstd,
+                                 Encoding::Gzip};
+  double best_q = 0;
+  Encoding best = Encoding::Identity;
+  auto offered = parseQualityList(accept_encoding);
+  auto wildcard = offered.find("*");
+  double wildcard_q = wildcard != offered.end() ? wildcard->second : -1;
+
+  for (Encoding encoding : preference) {
+    if (!encodingSupported(encoding))
+      continue;
+    auto it = offered.find(encodingName(encoding));
+    double q = it != offered.end() ? it->second : wildcard_q;
+    if (q > best_q) {
+      best_q = q;
+      best = encoding;
+    }
+  }
+  return best;
+}
+
+std::optional<std::string> compressBody(Encoding encoding,
+                                        const std::string &data,
+                                        const CompressionConfig &config) {
+  std::string out;
+  switch (encoding) {
+  case Encoding::Gzip: {
+    z_stream zs{};
+    if (deflateInit2(&zs, config.gzip_level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return std::nullopt;
+    out.resize(deflateBound(&zs, data.size()));
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = data.size();
+    zs.next_out = reinterpret_cast<Bytef *>(out.data());
+    zs.avail_out = out.size();
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END)
+      return std::nullopt;
+    return out;
+  }
+  case Encoding::Brotli: {
+#ifdef MAIL_BROTLI_SUPPORT
+    size_t size = BrotliEncoderMaxCompressedSize(data.size());
+    out.resize(size);
+    if (!BrotliEncoderCompress(
+            config.brotli_level, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+            data.size(), reinterpret_cast<const uint8_t *>(data.data()), &size,
+            reinterpret_cast<uint8_t *>(out.data())))
+      return std::nullopt;
+    out.resize(size);
+    return out;
+#else
+    return std::nullopt;
+#endif
+  }
+  case Encoding::Zstd: {
+#ifdef MAIL_ZSTD_SUPPORT
+    out.resize(ZSTD_compressBound(data.size()));
+    size_t size = ZSTD_compress(out.data(), out.size(), data.data(),
+                                data.size(), config.zstd_level);
+    if (ZSTD_isError(size))
+      return std::nullopt;
+    out.resize(size);
+    return out;
+#else
+    return std::nullopt;
+#endif
+  }
+  case Encoding::Identity:
+    break;
+  }
+  return std::nullopt;
+}
+
+// Compresses buffered API responses. Runs as the post-routing handler, after
+// httplib has already set Content-Length, so that header is rewritten.
+void compressResponse(const httplib::Request &req, httplib::Response &res,
+                      const CompressionConfig &config) {
+  if (res.body.size() < config.min_bytes ||
+      res.has_header("Content-Encoding") || res.has_header("Content-Range") ||
+      !compressible(res.get_header_value("Content-Type")))
+    return;
+
+  res.set_header("Vary", "Accept-Encoding");
+  Encoding encoding =
+      negotiateEncoding(req.get_header_value("Accept-Encoding"));
+  if (encoding == Encoding::Identity)
+    return;
+
+  auto compressed = compressBody(encoding, res.body, config);
+  if (!compressed || compressed->size() >= res.body.size())
+    return;
+
+  res.body = std::move(*compressed);
+  res.headers.erase("Content-Length");
+  res.set_header("Content-Length", std::to_string(res.body.size()));
+  res.set_header("Content-Encoding", encodingName(encoding));
+}
+
+const char *wireContentType(WireFormat format) {
+  switch (format) {
+  case WireFormat::Cbor:
+    return "application/cbor";
+  case WireFormat::MsgPack:
+    return "application/msgpack";
+  case WireFormat::Json:
+    break;
+  }
+  return "application/json";
+}
+
+WireFormat requestFormat(const httplib::Request &req) {
+  std::string type = req.get_header_value("Content-Type");
+  if (type.rfind("application/cbor", 0) == 0)
+    return WireFormat::Cbor;
+  if (type.rfind("application/msgpack", 0) == 0 ||
+      type.rfind("application/x-msgpack", 0) == 0)
+    return WireFormat::MsgPack;
+  return WireFormat::Json;
+}
+
+// Binary formats are only used when the client asks for them with a higher
+// q-value than JSON; anything else, including no Accept header, gets JSON.
+WireFormat responseFormat(const httplib::Request &req) {
+  auto accepted = parseQualityList(req.get_header_value("Accept"));
+  auto quality = [&accepted](std::initializer_list<const char *> names) {
+    double q = 0;
+    for (const char *name : names) {
+      auto it = accepted.find(name);
+      if (it != accepted.end())
+        q = std::max(q, it->second);
+    }
+    return q;
+  };
+
+  double json_q = accepted.empty()
+                      ? 1
+                      : quality({"application/json", "application/*", "*/*"});
+  double cbor_q = quality({"application/cbor"});
+  double msgpack_q = quality({"application/msgpack", "application/x-msgpack"});
+  if (cbor_q > json_q && cbor_q >= msgpack_q)
+    return WireFormat::Cbor;
+  if (msgpack_q > json_q)
+    return WireFormat::MsgPack;
+  return WireFormat::Json;
+}
+
+std::string encodeBody(WireFormat format, const json &body) {
+  std::string out;
+  switch (format) {
+  case WireFormat::Cbor:
+    json::to_cbor(body, out);
+    break;
+  case WireFormat::MsgPack:
+    json::to_msgpack(body, out);
+    break;
+  case WireFormat::Json:
+    out = body.dump();
+    break;
+  }
+  return out;
+}
+
+// Appends s as a JSON string literal escaped the way json::dump() does, so
+// bodies written without a DOM are byte-identical to the DOM path.
+template <typename String>
+void appendJsonString(String &out, std::string_view s) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  size_t run = 0;
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    out.append(s.data() + run, i - run);
+    run = i + 1;
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\b':
+      out += "\\b";
+      break;
+    case '\f':
+      out += "\\f";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    }
+  }
+  out.append(s.data() + run, s.size() - run);
+  out += '"';
+}
+
+// Writes a message list as a JSON array with the members in json's own
+// (sorted) key order. Works for both Message and MessageRow.
+template <typename String, typename Messages>
+void appendMessagesJson(String &out, const Messages &messages) {
+  size_t estimate = 2;
+  for (const auto &m : messages)
+    estimate += m.from.size() + m.to.size() + m.subject.size() +
+                m.body.size() + m.id.size() + 64;
+  out.reserve(out.size() + estimate);
+
+  out += '[';
+  bool first = true;
+  for (const auto &m : messages) {
+    if (!first)
+      out += ',';
+    first = false;
+    out += "{\"body\":";
+    appendJsonString(out, m.body);
+    out += ",\"from\":";
+    appendJsonString(out, m.from);
+    out += ",\"id\":";
+    appendJsonString(out, m.id);
+    out += ",\"subject\":";
+    appendJsonString(out, m.subject);
+    out += ",\"to\":";
+    appendJsonString(out, m.to);
+    out += '}';
+  }
+  out += ']';
+}
+
+void reply(const httplib::Request &req, httplib::Response &res,
+           const json &body) {
+  WireFormat format = responseFormat(req);
+  res.set_content(encodeBody(format, body), wireContentType(format));
+  res.set_header("Vary", "Accept");
+}
+
+// Schema-driven reader for the flat objects the API accepts. It walks the
+// body with nlohmann's SAX interface in whichever wire format the request
+// uses and moves matching top-level values straight into the caller's
+// variables, so no json tree is built. Unknown keys are skipped; a known
+// key with the wrong type or a missing required key is an error rather
+// than an exception from an implicit conversion.
+class FieldReader {
+private:
+  enum class Kind { String, Integer };
+
+  struct Target {
+    std::string_view name;
+    Kind kind = Kind::String;
+    bool required = false;
+    void *out = nullptr;
+    bool seen = false;
+  };
+
+  // Requests carry at most a handful of fields, so targets live inline.
+  std::array<Target, 4> targets;
+  size_t target_count = 0;
+
+  void add(Target target) {
+    if (target_count == targets.size())
+      throw std::logic_error("FieldReader supports at most 4 fields");
+    targets[target_count++] = target;
+  }
+
+  struct Handler {
+    FieldReader &reader;
+    int depth = 0;
+    Target *current = nullptr;
+    std::string error{};
+
+    bool fail(std::string message) {
+      error = std::move(message);
+      return false;
+    }
+
+    bool wrongType() {
+      return fail("field '" + std::string(current->name) + "' must be " +
+                  (current->kind == Kind::String ? "a string" : "an integer"));
+    }
+
+    bool tracked() const { return depth == 1 && current != nullptr; }
+
+    bool scalar() {
+      if (depth == 0)
+        return fail("request body must be an object");
+      return tracked() ? wrongType() : true;
+    }
+
+    bool null() { return scalar(); }
+    bool boolean(bool) { return scalar(); }
+    bool number_float(json::number_float_t, const std::string &) {
+      return scalar();
+    }
+    bool binary(json::binary_t &) { return scalar(); }
+
+    bool integer(int64_t value) {
+      if (depth == 0)
+        return fail("request body must be an object");
+      if (!tracked())
+        return true;
+      if (current->kind != Kind::Integer)
+        return wrongType();
+      if (value < std::numeric_limits<int>::min() ||
+          value > std::numeric_limits<int>::max())
+        return fail("field '" + std::string(current->name) +
+                    "' is out of range");
+      *static_cast<int *>(current->out) = static_cast<int>(value);
+      current->seen = true;
+      return true;
+    }
+
+    bool number_integer(json::number_integer_t value) { return integer(value); }
+    bool number_unsigned(json::number_unsigned_t value) {
+      return integer(value > uint64_t(INT64_MAX) ? INT64_MAX : int64_t(value));
+    }
+
+    bool string(std::string &value) {
+      if (depth == 0)
+        return fail("request body must be an object");
+      if (!tracked())
+        return true;
+      if (current->kind != Kind::String)
+        return wrongType();
+      *static_cast<std::string *>(current->out) = std::move(value);
+      current->seen = true;
+      return true;
+    }
+
+    bool start_object(std::size_t) {
+      if (tracked())
+        return wrongType();
+      depth++;
+      return true;
+    }
+
+    bool end_object() {
+      depth--;
+      return true;
+    }
+
+    bool start_array(std::size_t elements) {
+      if (depth == 0)
+        return fail("request body must be an object");
+      return start_object(elements);
+    }
+
+    bool end_array() { return end_object(); }
+
+    bool key(std::string &name) {
+      if (depth != 1)
+        return true;
+      current = nullptr;
+      for (size_t i = 0; i < reader.target_count; i++)
+        if (reader.targets[i].name == name)
+          current = &reader.targets[i];
+      return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &,
+                     const json::exception &) {
+      return fail("could not parse request body");
+    }
+  };
+
+public:
+  FieldReader &string(std::string_view name, std::string &out,
+                      bool required = true) {
+    add({name, Kind::String, required, &out});
+    return *this;
+  }
+
+  FieldReader &integer(std::string_view name, int &out,
+                       bool required = false) {
+    add({name, Kind::Integer, required, &out});
+    return *this;
+  }
+
+  // Returns an error message, or nullopt once every required field is set.
+  std::optional<std::string> read(const httplib::Request &req) {
+    Handler handler{*this};
+    json::input_format_t format = json::input_format_t::json;
+    switch (requestFormat(req)) {
+    case WireFormat::Cbor:
+      format = json::input_format_t::cbor;
+      break;
+    case WireFormat::MsgPack:
+      format = json::input_format_t::msgpack;
+      break;
+    case WireFormat::Json:
+      break;
+    }
+
+    if (!json::sax_parse(req.body, &handler, format))
+      return handler.error.empty() ? "could not parse request body"
+                                   : handler.error;
+
+    for (size_t i = 0; i < target_count; i++)
+      if (targets[i].required && !targets[i].seen)
+        return "missing field '" + std::string(targets[i].name) + "'";
+    return std::nullopt;
+  }
+};
+
+bool etagMatches(const std::string &if_none_match, const std::string &etag) {
+  if (if_none_match.empty())
+    return false;
+  if (if_none_match == "*")
+    return true;
+  size_t pos = 0;
+  while (pos < if_none_match.size()) {
+    size_t end = if_none_match.find(',', pos);
+    if (end == std::string::npos)
+      end = if_none_match.size();
+    std::string candidate = if_none_match.substr(pos, end - pos);
+    candidate.erase(0, candidate.find_first_not_of(" \t"));
+    candidate.erase(candidate.find_last_not_of(" \t") + 1);
+    if (candidate.rfind("W/", 0) == 0)
+      candidate.erase(0, 2);
+    if (candidate == etag)
+      return true;
+    pos = end + 1;
+  }
+  return false;
+}
+
+// Serves ./public from memory. Every file is read once at startup (or on
+// reload) together with its content type, strong ETag, Cache-Control and
+// precompressed variants, so a request is a map lookup and never touches
+// the filesystem. With MAIL_STATIC_RELOAD=1 an inotify watch rebuilds the
+// table whenever something under the root changes.
+class StaticAssets {
+private:
+  struct Variant {
+    std::shared_ptr<const std::string> data;
+    std::string etag;
+  };
+
+  struct Asset {
+    std::string content_type;
+    std::string cache_control;
+    std::map<Encoding, Variant> variants;
+  };
+
+  using Table = std::map<std::string, Asset>;
+
+  std::string root;
+  CompressionConfig config;
+  std::shared_ptr<const Table> table;
+  mutable std::shared_mutex mtx;
+  std::atomic<uint64_t> reloads{0};
+  std::atomic<uint64_t> not_modified{0};
+
+  std::thread watcher;
+  std::atomic<bool> stopping{false};
+  int inotify_fd = -1;
+
+  static std::string strongEtag(const std::string &data, Encoding encoding) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : data) {
+      hash ^= c;
+      hash *= 1099511628211ull;
+    }
+    std::stringstream ss;
+    ss << '"' << std::hex << std::setw(16) << std::setfill('0') << hash;
+    if (encoding != Encoding::Identity)
+      ss << '-' << encodingName(encoding);
+    ss << '"';
+    return ss.str();
+  }
+
+  std::shared_ptr<const Table> load() const {
+    CompressionConfig best = config;
+    best.gzip_level = 9;
+    best.brotli_level = 11;
+    best.zstd_level = 19;
+    size_t max_age = envOr("MAIL_STATIC_MAX_AGE", 0);
+    std::string cache_control =
+        max_age == 0 ? "no-cache"
+                     : "public, max-age=" + std::to_string(max_age);
+
+    auto loaded = std::make_shared<Table>();
+    std::error_code ec;
+    for (const auto &file :
+         std::filesystem::recursive_directory_iterator(root, ec)) {
+      if (!file.is_regular_file())
+        continue;
+      std::string path = file.path().string();
+      std::ifstream in(path, std::ios::binary);
+      if (!in)
+        continue;
+      auto data = std::make_shared<const std::string>(
+          std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+      Asset asset;
+      asset.content_type = httplib::detail::find_content_type(
+          path, {}, "application/octet-stream");
+      asset.cache_control = cache_control;
+      asset.variants[Encoding::Identity] = {
+          data, strongEtag(*data, Encoding::Identity)};
+
+      if (compressible(asset.content_type) && data->size() >= config.min_bytes) {
+        for (Encoding encoding :
+             {Encoding::Gzip, Encoding::Brotli, Encoding::Zstd}) {
+          if (!encodingSupported(encoding))
+            continue;
+          auto compressed = compressBody(encoding, *data, best);
+          if (compressed && compressed->size() < data->size())
+            asset.variants[encoding] = {
+                std::make_shared<const std::string>(std::move(*compressed)),
+                strongEtag(*data, encoding)};
+        }
+      }
+
+      std::string url = "/" + std::filesystem::relative(file.path(), root).
+                                  generic_string();
+      (*loaded)[url] = std::move(asset);
+    }
+    return loaded;
+  }
+
+  void watch() {
+    std::vector<char> buffer(4096);
+    while (!stopping) {
+      pollfd pfd{inotify_fd, POLLIN, 0};
+      if (::poll(&pfd, 1, 500) <= 0)
+        continue;
+      bool changed = false;
+      while (::read(inotify_fd, buffer.data(), buffer.size()) > 0)
+        changed = true;
+      if (!changed)
+        continue;
+      // Editors write in several steps; let them settle before reloading.
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      while (::read(inotify_fd, buffer.data(), buffer.size()) > 0)
+        ;
+      reload();
+    }
+  }
+
+  void addWatches() {
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                          IN_CREATE | IN_DELETE;
+    inotify_add_watch(inotify_fd, root.c_str(), mask);
+    std::error_code ec;
+    for (const auto &entry :
+         std::filesystem::recursive_directory_iterator(root, ec))
+      if (entry.is_directory())
+        inotify_add_watch(inotify_fd, entry.path().c_str(), mask);
+  }
+
+public:
+  StaticAssets(std::string root, const CompressionConfig &config)
+      : root(std::move(root)), config(config) {
+    table = load();
+
+    if (envOr("MAIL_STATIC_RELOAD", 0) != 0) {
+      inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (inotify_fd < 0) {
+        std::cerr << "inotify unavailable, static reload disabled\n";
+      } else {
+        addWatches();
+        watcher = std::thread([this] { watch(); });
+      }
+    }
+  }
+
+  StaticAssets(const StaticAssets &) = delete;
+  StaticAssets &operator=(const StaticAssets &) = delete;
 
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+  ~StaticAssets() {
+    stopping = true;
+    if (watcher.joinable())
+      watcher.join();
+    if (inotify_fd >= 0)
+      ::close(inotify_fd);
+  }
 
-    return rc == SQLITE_DONE;
+  void reload() {
+    auto loaded = load();
+    {
+      std::unique_lock<std::shared_mutex> lock(mtx);
+      table = std::move(loaded);
+    }
+    if (inotify_fd >= 0)
+      addWatches();
+    reloads++;
   }
 
-  bool verifyUser(const std::string &username, const std::string &password) {
-    sqlite3_stmt *stmt;
-    const char *sql = "select password from users where username = ?";
+  // Returns false when the path isn't a known asset.
+  bool serve(const httplib::Request &req, httplib::Response &res) {
+    std::shared_ptr<const Table> current;
+    {
+      std::shared_lock<std::shared_mutex> lock(mtx);
+      current = table;
+    }
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    std::string path = req.path;
+    if (path.empty() || path.back() == '/')
+      path += "index.html";
+    auto it = current->find(path);
+    if (it == current->end())
       return false;
+    const Asset &asset = it->second;
+
+    Encoding encoding =
+        negotiateEncoding(req.get_header_value("Accept-Encoding"));
+    auto variant = asset.variants.find(encoding);
+    if (variant == asset.variants.end()) {
+      encoding = Encoding::Identity;
+      variant = asset.variants.find(encoding);
     }
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    res.set_header("ETag", variant->second.etag);
+    res.set_header("Cache-Control", asset.cache_control);
+    if (asset.variants.size() > 1)
+      res.set_header("Vary", "Accept-Encoding");
 
-    bool verified = false;
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-      const char *stored_password =
-          reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-      verified = (password == stored_password);
+    if (etagMatches(req.get_header_value("If-None-Match"),
+                    variant->second.etag)) {
+      not_modified++;
+      res.status = 304;
+      return true;
     }
 
-    sqlite3_finalize(stmt);
-    return verified;
+    if (encoding != Encoding::Identity)
+      res.set_header("Content-Encoding", encodingName(encoding));
+    std::shared_ptr<const std::string> data = variant->second.data;
+    res.set_content_provider(
+        data->size(), asset.content_type,
+        [data](size_t offset, size_t length, httplib::DataSink &sink) {
+          return sink.write(data->data() + offset, length);
+        });
+    return true;
   }
 
-  bool userExists(const std::string &username) {
-    sqlite3_stmt *stmt;
-    const char *sql = "select 1 from users where username = ?";
-
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-      return false;
+  json stats() const {
+    std::shared_ptr<const Table> current;
+    {
+      std::shared_lock<std::shared_mutex> lock(mtx);
+      current = table;
     }
+    json assets = json::object();
+    for (const auto &[path, asset] : *current) {
+      json variants = json::object();
+      for (const auto &[encoding, variant] : asset.variants)
+        variants[encodingName(encoding)] = variant.data->size();
+      assets[path] = variants;
+    }
+    return {{"assets", assets},
+            {"reloads", reloads.load()},
+            {"not_modified", not_modified.load()}};
+  }
+};
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+std::optional<std::string> authenticate(const SessionStore &sessions,
+                                        const httplib::Request &req,
+                                        httplib::Response &res) {
+  std::string auth = req.get_header_value("Authorization");
 
-    bool exists = (sqlite3_step(stmt) == SQLITE_ROW);
-    sqlite3_finalize(stmt);
-    return exists;
+  if (auth.empty() || auth.substr(0, 7) != "Bearer ") {
+    res.status = 401;
+    return std::nullopt;
   }
 
-  bool createMessage(const Message &msg) {
-    sqlite3_stmt *stmt;
-    const char *sql = "insert into messages (id, from_user, to_user, subject, "
-                      "body) VALUES (?, ?, ?, ?, ?)";
+  auto username = sessions.find(auth.substr(7));
+  if (!username) {
+    res.status = 401;
+    json msg = {"error", "session expired"};
+    reply(req, res, msg);
+  }
+  return username;
+}
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-      return false;
-    }
+enum class Priority { Critical, Normal, Low };
 
-    sqlite3_bind_text(stmt, 1, msg.id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, msg.from.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, msg.to.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 4, msg.subject.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 5, msg.body.c_str(), -1, SQLITE_TRANSIENT);
+enum class DbOp { Read = 0, Write = 1 };
 
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+struct RouteLimit {
+  Priority priority;
+  size_t max_concurrency;
+  std::chrono::milliseconds queue_budget;
+};
 
-    return rc == SQLITE_DONE;
-  }
+// Per-route concurrency caps under a shared AIMD limit. The shared limit
+// grows by one while DB latency stays near its observed floor and backs off
+// multiplicatively once it climbs, and lower priorities only get a fraction
+// of it, so they are shed first.
+class AdmissionController {
+private:
+  using clock = std::chrono::steady_clock;
 
-  std::vector<Message> getMessagesForUser(const std::string &username) {
-    std::vector<Message> messages;
-    sqlite3_stmt *stmt;
-    const char *sql = "select id, from_user, to_user, subject, body from "
-                      "messages where to_user = ? order by created_at desc";
+  struct Route {
+    RouteLimit limit;
+    size_t inflight = 0;
+    uint64_t admitted = 0;
+    uint64_t rejected = 0;
+  };
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-      return messages;
-    }
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::map<std::string, Route> routes;
+  size_t inflight = 0;
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+  // Reads and writes are tracked separately; a write's fsync would
+  // otherwise look like congestion against the read floor.
+  struct LatencySignal {
+    double floor_us = 0;
+    double ewma_us = 0;
+  };
 
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-      std::string id =
-          reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-      std::string from =
-          reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-      std::string to =
-          reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
-      std::string subject =
-          reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
-      std::string body =
-          reinterpret_cast<const char *>(sqlite3_column_text(stmt, 4));
+  double limit;
+  double min_limit;
+  double max_limit;
+  double tolerance;
+  double slack_us;
+  LatencySignal signals[2];
+  clock::time_point last_decrease;
+  uint64_t decreases = 0;
 
-      messages.emplace_back(from, to, subject, body, id);
+  double share(Priority priority) const {
+    switch (priority) {
+    case Priority::Critical:
+      return 1.0;
+    case Priority::Normal:
+      return 0.75;
+    case Priority::Low:
+      return 0.25;
     }
+    return 1.0;
+  }
 
-    sqlite3_finalize(stmt);
-    return messages;
+  bool fits(const Route &route) const {
+    return route.inflight < route.limit.max_concurrency &&
+           inflight < std::max(1.0, limit * share(route.limit.priority));
   }
 
-  bool deleteMessage(const std::string &username, const std::string &msg_id) {
-    sqlite3_stmt *stmt;
-    const char *sql = "delete from messages where id = ? and to_user = ?";
+public:
+  class Ticket {
+  private:
+    AdmissionController *owner;
+    Route *route;
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-      return false;
+  public:
+    Ticket(AdmissionController *owner, Route *route)
+        : owner(owner), route(route) {}
+    Ticket(Ticket &&other) noexcept : owner(other.owner), route(other.route) {
+      other.owner = nullptr;
     }
+    Ticket(const Ticket &) = delete;
+    Ticket &operator=(const Ticket &) = delete;
+    Ticket &operator=(Ticket &&) = delete;
 
-    sqlite3_bind_text(stmt, 1, msg_id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, username.c_str(), -1, SQLITE_TRANSIENT);
+    ~Ticket() {
+      if (owner == nullptr)
+        return;
+      {
+        std::lock_guard<std::mutex> lock(owner->mtx);
+        route->inflight--;
+        owner->inflight--;
+      }
+      owner->cv.notify_all();
+    }
+  };
 
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+  AdmissionController()
+      : limit(envOr("MAIL_ADMISSION_LIMIT", 32)),
+        min_limit(envOr("MAIL_ADMISSION_MIN", 4)),
+        max_limit(envOr("MAIL_ADMISSION_MAX", 256)),
+        tolerance(envOr("MAIL_ADMISSION_TOLERANCE", 3)),
+        slack_us(envOr("MAIL_ADMISSION_SLACK_US", 2000)) {}
 
-    return rc == SQLITE_DONE && sqlite3_changes(db) > 0;
+  void addRoute(const std::string &name, RouteLimit route_limit) {
+    std::lock_guard<std::mutex> lock(mtx);
+    routes[name].limit = route_limit;
   }
 
-  bool deleteUser(const std::string &username) {
-    sqlite3_stmt *stmt;
-    const char *sql = "delete from messages where to_user = ?";
+  // Waits at most the route's queue budget for a slot. Routes must be
+  // registered before the server starts.
+  std::optional<Ticket> admit(const std::string &name) {
+    std::unique_lock<std::mutex> lock(mtx);
+    Route &route = routes.at(name);
+    auto deadline = clock::now() + route.limit.queue_budget;
+    if (!cv.wait_until(lock, deadline, [&] { return fits(route); })) {
+      route.rejected++;
+      return std::nullopt;
+    }
+    route.inflight++;
+    route.admitted++;
+    inflight++;
+    return Ticket(this, &route);
+  }
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-      return false;
+  void recordLatency(DbOp op, clock::duration elapsed) {
+    double us =
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    auto now = clock::now();
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      LatencySignal &signal = signals[static_cast<int>(op)];
+      signal.ewma_us =
+          signal.ewma_us == 0 ? us : 0.9 * signal.ewma_us + 0.1 * us;
+      // Let the floor drift up slowly so a one-off fast sample doesn't pin
+      // the limiter into backing off forever.
+      signal.floor_us = signal.floor_us == 0
+                            ? us
+                            : std::min(us, signal.floor_us * 1.001 + 1);
+
+      if (signal.ewma_us > signal.floor_us * tolerance &&
+          signal.ewma_us > signal.floor_us + slack_us) {
+        if (now - last_decrease > std::chrono::milliseconds(100)) {
+          limit = std::max(min_limit, limit * 0.9);
+          last_decrease = now;
+          decreases++;
+        }
+      } else if (inflight + 1 >= limit) {
+        limit = std::min(max_limit, limit + 1.0 / limit);
+      }
     }
+    cv.notify_all();
+  }
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+  json stats() {
+    std::lock_guard<std::mutex> lock(mtx);
+    json route_stats = json::object();
+    for (const auto &[name, route] : routes) {
+      route_stats[name] = {{"inflight", route.inflight},
+                           {"max_concurrency", route.limit.max_concurrency},
+                           {"admitted", route.admitted},
+                           {"rejected", route.rejected}};
+    }
+    return {{"limit", limit},
+            {"inflight", inflight},
+            {"read_latency_us", signals[0].ewma_us},
+            {"read_latency_floor_us", signals[0].floor_us},
+            {"write_latency_us", signals[1].ewma_us},
+            {"write_latency_floor_us", signals[1].floor_us},
+            {"decreases", decreases},
+            {"routes", route_stats}};
+  }
+};
 
-    const char *sql2 = "delete from messages where from_user = ?";
-    if (sqlite3_prepare_v2(db, sql2, -1, &stmt, nullptr) != SQLITE_OK) {
-      return false;
+httplib::Server::Handler admitted(AdmissionController &admission,
+                                  const std::string &name, RouteLimit limit,
+                                  httplib::Server::Handler handler) {
+  admission.addRoute(name, limit);
+  return [&admission, name, handler](const httplib::Request &req,
+                                     httplib::Response &res) {
+    auto ticket = admission.admit(name);
+    if (!ticket) {
+      res.status = 503;
+      res.set_header("Retry-After", "1");
+      json error = {{"error", "server overloaded"}};
+      reply(req, res, error);
+      return;
     }
+    RequestArena::Scope arena;
+    handler(req, res);
+  };
+}
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+// Forks the workers, each of which runs the whole server on the same port:
+// httplib sets SO_REUSEPORT on its listener, so the kernel spreads
+// connections across them. The supervisor restarts workers that die and
+// returns nothing once it is told to stop; in a worker it returns that
+// worker's index. Must be called before any thread is started.
+std::optional<size_t> superviseWorkers(size_t workers,
+                                       const sigset_t &stop_signals) {
+  sigset_t signals = stop_signals;
+  sigaddset(&signals, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
-    const char *sql3 = "delete from users where username = ?";
-    if (sqlite3_prepare_v2(db, sql3, -1, &stmt, nullptr) != SQLITE_OK) {
-      return false;
+  pid_t supervisor = getpid();
+  std::map<pid_t, size_t> running;
+  auto spawn = [&](size_t index) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      if (getppid() != supervisor)
+        _exit(0);
+      sigset_t child;
+      sigemptyset(&child);
+      sigaddset(&child, SIGCHLD);
+      pthread_sigmask(SIG_UNBLOCK, &child, nullptr);
+      return true;
     }
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    if (pid < 0)
+      std::cerr << "could not fork worker " << index << '\n';
+    else
+      running[pid] = index;
+    return false;
+  };
 
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+  for (size_t i = 0; i < workers; i++)
+    if (spawn(i))
+      return i;
 
-    return rc == SQLITE_DONE && sqlite3_changes(db) > 0;
+  for (;;) {
+    int signal;
+    sigwait(&signals, &signal);
+    if (signal != SIGCHLD)
+      break;
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      auto it = running.find(pid);
+      if (it == running.end())
+        continue;
+      size_t index = it->second;
+      running.erase(it);
+      std::cerr << "worker " << index << " exited with status " << status
+                << ", restarting\n";
+      // Don't spin if it dies on startup.
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      if (spawn(index))
+        return index;
+    }
   }
 
-  std::vector<std::string> getUsers() {
-    std::vector<std::string> users;
-    sqlite3_stmt *stmt;
-    const char *sql = "select username from users order by username";
+  for (const auto &[pid, index] : running)
+    kill(pid, SIGTERM);
+  while (!running.empty()) {
+    pid_t pid = waitpid(-1, nullptr, 0);
+    if (pid < 0)
+      break;
+    running.erase(pid);
+  }
+  return std::nullopt;
+}
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-      return users;
-    }
+int main(int argc, char **argv) {
+  if (argc > 1 && std::string_view(argv[1]) == "--rebalance")
+    return rebalanceShards();
 
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-      std::string username =
-          reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-      users.push_back(username);
-    }
+  // SIGINT and SIGTERM are taken by one waiter thread that stops the server,
+  // so main returns and buffered state (the session log) is written out.
+  // They must be blocked before any other thread starts.
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
 
-    sqlite3_finalize(stmt);
-    return users;
+  // With MAIL_WORKERS > 1 the server runs as that many processes. Anything
+  // they must agree on lives in the tables below, which are mapped shared
+  // before forking; each worker has its own caches of everything else, and
+  // its own rate limit and admission state.
+  const size_t workers = std::max<size_t>(1, envOr("MAIL_WORKERS", 1));
+  RevocationTable revocations(workers > 1);
+  InboxVersions inbox_versions(workers > 1);
+  size_t worker = 0;
+  if (workers > 1) {
+    // Map sessions would only be known to the worker that made them.
+    if (!std::getenv("MAIL_SESSION_KEYS")) {
+      std::cerr << "MAIL_WORKERS needs signed sessions; set "
+                   "MAIL_SESSION_KEYS to keep them across restarts\n";
+      setenv("MAIL_SESSION_KEYS", generateToken().c_str(), 1);
+    }
+    // The log engine's index lives in the process that replayed the log.
+    if (Database::engine() == Database::Engine::Log) {
+      std::cerr << "MAIL_WORKERS can't be used with MAIL_DB_ENGINE=log\n";
+      return 1;
+    }
+    // Run migrations once, before the workers race to open the databases.
+    for (size_t i = 0; i < Executors::dbShards(); i++)
+      SqliteDatabase(MessageShards::path(i), 1);
+    auto index = superviseWorkers(workers, stop_signals);
+    if (!index)
+      return 0;
+    worker = *index;
   }
-};
 
-std::string generateToken() {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_int_distribution<> dis(0, 255);
+  Executors pools;
+  auto storage = openDatabase(MessageShards::path(0), pools.reads.threads());
+  Database &db = *storage;
+  MessageShards shards(db, pools);
+  shards.startCheckpoints();
+  // One process is enough to look after the files.
+  if (worker == 0)
+    shards.startMaintenance();
+  Backups backups(shards);
 
-  std::stringstream ss;
-  for (int i = 0; i < 32; i++) {
-    ss << std::hex << std::setw(2) << std::setfill('0') << dis(gen);
+  const char *session_log = std::getenv("MAIL_SESSION_LOG");
+  SessionStore sessions(revocations,
+                        session_log ? session_log : "sessions.log", worker,
+                        workers);
+  InboxCache cache(envOr("MAIL_INBOX_CACHE_MB", 64) << 20, inbox_versions);
+
+  using namespace std::chrono_literals;
+  AdmissionController admission;
+  pools.reads.observe([&admission](auto elapsed) {
+    admission.recordLatency(DbOp::Read, elapsed);
+  });
+  pools.writes.observe([&admission](auto elapsed) {
+    admission.recordLatency(DbOp::Write, elapsed);
+  });
+  for (size_t i = 1; i < shards.size(); i++) {
+    shards.shard(i).reads.observe([&admission](auto elapsed) {
+      admission.recordLatency(DbOp::Read, elapsed);
+    });
+    shards.shard(i).writes.observe([&admission](auto elapsed) {
+      admission.recordLatency(DbOp::Write, elapsed);
+    });
   }
-  return ss.str();
-}
 
-int main() {
-  Database db("messages.db");
+  httplib::Server svr;
 
-  std::map<std::string, std::string> sessions;
+  // Handlers mostly wait on the executors below, so the HTTP pool can be
+  // much wider than the number of threads actually touching SQLite.
+  svr.new_task_queue = [] {
+    return new httplib::ThreadPool(envOr("MAIL_HTTP_THREADS", 64));
+  };
 
-  httplib::Server svr;
+  svr.set_exception_handler(
+      [](const auto &req, auto &res, std::exception_ptr ep) {
+        try {
+          std::rethrow_exception(ep);
+        } catch (const ExecutorBusy &e) {
+          res.status = 503;
+          res.set_header("Retry-After", "1");
+          json error = {{"error", "server busy"}};
+          reply(req, res, error);
+        } catch (const std::exception &e) {
+          res.status = 500;
+          json error = {{"error", e.what()}};
+          reply(req, res, error);
+        }
+      });
+
+  RateLimiter auth_per_ip("auth-ip", envOr("MAIL_AUTH_BURST", 10), 0.5);
+  RateLimiter sends_per_user("send-user", envOr("MAIL_SEND_BURST", 30), 2);
+  RateLimiter sends_per_ip("send-ip", envOr("MAIL_SEND_BURST", 30) * 2, 5);
+  std::vector<RateRule> rate_rules = {
+      {"/api/login", RateKey::RemoteAddr, &auth_per_ip},
+      {"/api/createusr", RateKey::RemoteAddr, &auth_per_ip},
+      {"/api/createmsg", RateKey::SessionUser, &sends_per_user},
+      {"/api/createmsg", RateKey::RemoteAddr, &sends_per_ip},
+  };
+
+  // Runs before the body is read, so a flooding client costs a hash lookup
+  // and a CAS rather than JSON parsing, token generation or a DB round trip.
+  svr.set_pre_routing_handler([&rate_rules, &sessions](const auto &req,
+                                                       auto &res) {
+    for (const auto &rule : rate_rules) {
+      if (rule.path != req.path)
+        continue;
+
+      std::string key;
+      if (rule.key == RateKey::RemoteAddr) {
+        key = req.remote_addr;
+      } else {
+        std::string auth = req.get_header_value("Authorization");
+        if (auth.substr(0, 7) != "Bearer ")
+          continue;
+        auto username = sessions.find(auth.substr(7));
+        if (!username)
+          continue;
+        key = *username;
+      }
 
-  svr.set_mount_point("/", "./public");
+      if (!rule.limiter->allow(key)) {
+        res.status = 429;
+        res.set_header("Retry-After",
+                       std::to_string(rule.limiter->retryAfterSeconds()));
+        json error = {{"error", "too many requests"}};
+        reply(req, res, error);
+        return httplib::Server::HandlerResponse::Handled;
+      }
+    }
+    return httplib::Server::HandlerResponse::Unhandled;
+  });
+
+  CompressionConfig compression;
+  StaticAssets assets("./public", compression);
+  PasswordHasher hasher;
+
+  svr.Get("/.*", [&assets](const auto &req, auto &res) {
+    if (!assets.serve(req, res))
+      res.status = 404;
+  });
+  svr.set_post_routing_handler([&compression](const auto &req, auto &res) {
+    compressResponse(req, res, compression);
+  });
 
-  svr.Post("/api/login", [&db, &sessions](const auto &req, auto &res) {
+  svr.Post("/api/login",
+           admitted(admission, "login", {Priority::Critical, 64, 250ms},
+                    [&db, &sessions, &pools, &hasher](const auto &req,
+                                                      auto &res) {
     std::string uname;
     std::string password;
 
-    try {
-      auto j = json::parse(req.body);
-      uname = j["username"];
-      password = j["password"];
-    } catch (json::parse_error &e) {
+    auto error = FieldReader()
+                     .string("username", uname)
+                     .string("password", password)
+                     .read(req);
+    if (error) {
       res.status = 400;
-      json error = {"error", "could not parse JSON"};
-      res.set_content(error.dump(), "application/json");
+      json response = {{"error", *error}};
+      reply(req, res, response);
       return;
-    };
+    }
 
-    if (!db.userExists(uname)) {
+    auto stored = pools.reads.run([&] { return db.getPassword(uname); });
+    if (!stored) {
       res.status = 404;
-      res.set_content(R"({"error": "user not found")", "application/json");
+      reply(req, res, {{"error", "user not found"}});
       return;
     }
 
-    if (db.verifyUser(uname, password)) {
+    auto check =
+        pools.hashing.run([&] { return hasher.verify(password, *stored); });
+    if (check.ok && check.rehash)
+      pools.writes.run([&] { return db.setPassword(uname, *check.rehash); });
+
+    if (check.ok) {
       res.status = 200;
-      std::string token = generateToken();
-      sessions[token] = uname;
+      std::string token = sessions.issue(uname);
 
       json response = {
           {"success", true}, {"token", token}, {"username", uname}};
 
-      res.set_content(response.dump(), "application/json");
+      reply(req, res, response);
     } else {
       res.status = 401;
       json error_str = {{"error", "incorrect password"}};
-      res.set_content(error_str.dump(), "application/json");
+      reply(req, res, error_str);
     }
-  });
+  }));
 
-  svr.Post("/api/logout", [&db, &sessions](const auto &req, auto &res) {
+  svr.Post("/api/logout", [&sessions](const auto &req, auto &res) {
     std::string auth = req.get_header_value("Authorization");
     if (auth.empty() || auth.substr(0, 7) != "Bearer ") {
       res.status = 401;
       return;
     }
 
-    std::string token = auth.substr(7);
-    auto it = sessions.find(token);
-    if (it == sessions.end()) {
+    if (!sessions.remove(auth.substr(7))) {
       res.status = 401;
       json msg = {"error", "session expired"};
-      res.set_content(msg.dump(), "application/json");
+      reply(req, res, msg);
       return;
     }
 
-    sessions.erase(it);
     res.status = 200;
     return;
   });
 
-  svr.Post("/api/createusr", [&db](const auto &req, auto &res) {
+  svr.Post("/api/createusr",
+           admitted(admission, "createusr", {Priority::Normal, 8, 100ms},
+                    [&db, &pools, &hasher](const auto &req, auto &res) {
     std::string uname;
     std::string passwd;
 
-    try {
-      auto body = json::parse(req.body);
-      uname = body["username"];
-      passwd = body["password"];
-    } catch (json::parse_error &e) {
+    auto error = FieldReader()
+                     .string("username", uname)
+                     .string("password", passwd)
+                     .read(req);
+    if (error) {
       res.status = 400;
-      json error = {"error", "could not parse JSON"};
-      res.set_content(error.dump(), "application/json");
+      json response = {{"error", *error}};
+      reply(req, res, response);
       return;
     }
 
-    if (db.userExists(uname)) {
+    if (pools.reads.run([&] { return db.userExists(uname); })) {
       res.status = 409;
-      json response = {"error", "user exists."};
-      res.set_content(response.dump(), "application/json");
+      json response = {{"error", "user exists."}};
+      reply(req, res, response);
       return;
     }
 
-    db.createUser(uname, passwd);
+    // The check above is only a fast path: a concurrent signup can take the
+    // name while the password is hashed, and the insert's unique constraint
+    // decides. A failed insert for a name that now exists lost that race.
+    std::string hash = pools.hashing.run([&] { return hasher.hash(passwd); });
+    if (!pools.writes.run([&] { return db.createUser(uname, hash); })) {
+      bool taken = pools.reads.run([&] { return db.userExists(uname); });
+      res.status = taken ? 409 : 500;
+      json response = {
+          {"error", taken ? "user exists." : "could not create user"}};
+      reply(req, res, response);
+      return;
+    }
 
     res.status = 200;
-  });
+  }));
 
-  svr.Post("/api/getmsgs", [&db, &sessions](const auto &req, auto &res) {
-    std::string auth = req.get_header_value("Authorization");
+  svr.Post("/api/getmsgs",
+           admitted(admission, "getmsgs", {Priority::Critical, 64, 250ms},
+                    [&db, &shards, &sessions, &pools, &cache](const auto &req,
+                                                              auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
+      return;
 
-    if (auth.empty() || auth.substr(0, 7) != "Bearer ") {
-      res.status = 401;
+    WireFormat format = responseFormat(req);
+    res.set_header("Vary", "Accept");
+    std::string etag = cache.etag(cache.version(*username), format);
+    if (etagMatches(req.get_header_value("If-None-Match"), etag)) {
+      res.status = 304;
+      res.set_header("ETag", etag);
       return;
     }
 
-    std::string token = auth.substr(7);
-    auto it = sessions.find(token);
-    if (it == sessions.end()) {
-      res.status = 401;
-      json msg = {"error", "session expired"};
-      res.set_content(msg.dump(), "application/json");
-      return;
+    auto snapshot = cache.get(*username, format);
+    if (!snapshot.inbox) {
+      if (!pools.reads.run([&] { return db.userExists(*username); }))
+        return;
+      auto shard = shards.route(*username);
+      snapshot.inbox = std::make_shared<const Inbox>(shard.reads.run(
+          [&] { return shard.db.getMessagesForUser(*username); }));
+      cache.put(*username, snapshot.inbox, snapshot.version);
     }
 
-    std::string username = it->second;
+    if (!snapshot.body) {
+      snapshot.body = pools.cpu.run([&] {
+        std::string body;
+        if (format == WireFormat::Json) {
+          body = "{\"messages\":";
+          appendMessagesJson(body, *snapshot.inbox);
+          body += '}';
+        } else {
+          json msg_array = json::array();
+          for (const auto &m : *snapshot.inbox)
+            msg_array.push_back(m);
+          body = encodeBody(format, {{"messages", msg_array}});
+        }
+        return std::make_shared<const std::string>(std::move(body));
+      });
+      cache.putBody(*username, snapshot.version, format, snapshot.body);
+    }
 
-    if (db.userExists(username)) {
-      res.status = 200;
-      std::vector<Message> msgs = db.getMessagesForUser(username);
-      json msg_array = json::array();
-      for (const auto &m : msgs)
-        msg_array.push_back(m);
-      json response = {{"messages", msg_array}};
-      res.set_content(response.dump(), "application/json");
+    res.status = 200;
+    res.set_header("ETag", cache.etag(snapshot.version, format));
+    res.set_content(*snapshot.body, wireContentType(format));
+  }));
+
+  svr.Post("/api/search",
+           admitted(admission, "search", {Priority::Normal, 16, 100ms},
+                    [&shards, &sessions, &pools](const auto &req,
+                                                 auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
       return;
-    }
-  });
 
-  svr.Post("/api/createmsg", [&db, &sessions](const auto &req, auto &res) {
-    std::string auth = req.get_header_value("Authorization");
+    std::string query;
+    int limit = 20;
+    int offset = 0;
 
-    if (auth.empty() || auth.substr(0, 7) != "Bearer ") {
-      res.status = 401;
+    auto error = FieldReader()
+                     .string("query", query)
+                     .integer("limit", limit)
+                     .integer("offset", offset)
+                     .read(req);
+    if (error) {
+      res.status = 400;
+      json response = {{"error", *error}};
+      reply(req, res, response);
       return;
     }
 
-    std::string token = auth.substr(7);
-    auto it = sessions.find(token);
-    if (it == sessions.end()) {
-      res.status = 401;
-      json msg = {"error", "session expired"};
-      res.set_content(msg.dump(), "application/json");
+    limit = std::clamp(limit, 1, 100);
+    offset = std::max(offset, 0);
+
+    // Ask for one extra row so the client knows whether to offer a next page.
+    auto arena = RequestArena::resource();
+    auto shard = shards.route(*username);
+    MessageRows msgs = shard.reads.run([&] {
+      return shard.db.searchMessages(*username, query, limit + 1, offset,
+                                     arena);
+    });
+    bool has_more = msgs.size() > static_cast<size_t>(limit);
+    if (has_more)
+      msgs.pop_back();
+
+    WireFormat format = responseFormat(req);
+    std::pmr::string body(arena);
+    pools.cpu.run([&] {
+      if (format == WireFormat::Json) {
+        body += has_more ? "{\"has_more\":true" : "{\"has_more\":false";
+        body += ",\"limit\":" + std::to_string(limit);
+        body += ",\"messages\":";
+        appendMessagesJson(body, msgs);
+        body += ",\"offset\":" + std::to_string(offset);
+        body += '}';
+        return;
+      }
+      json msg_array = json::array();
+      for (const auto &m : msgs)
+        msg_array.push_back(m);
+      json response = {{"messages", msg_array},
+                       {"offset", offset},
+                       {"limit", limit},
+                       {"has_more", has_more}};
+      body = encodeBody(format, response);
+    });
+    res.status = 200;
+    res.set_header("Vary", "Accept");
+    res.set_content(body.data(), body.size(), wireContentType(format));
+  }));
+
+  svr.Post("/api/createmsg",
+           admitted(admission, "createmsg", {Priority::Normal, 32, 100ms},
+                    [&db, &shards, &sessions, &pools, &cache](const auto &req,
+                                                              auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
       return;
-    }
 
-    std::string username = it->second;
     std::string to, subject, body;
 
-    try {
-      auto data = json::parse(req.body);
-      to = data["to"];
-      subject = data["subject"];
-      body = data["body"];
-    } catch (json::parse_error &e) {
+    auto error = FieldReader()
+                     .string("to", to)
+                     .string("subject", subject)
+                     .string("body", body)
+                     .read(req);
+    if (error) {
       res.status = 400;
-      json error = {{"error", "failed to parse JSON"}};
-      res.set_content(error.dump(), "application/json");
+      json response = {{"error", *error}};
+      reply(req, res, response);
       return;
     }
 
-    if (!db.userExists(to)) {
+    if (!pools.reads.run([&] { return db.userExists(to); })) {
       res.status = 404;
       json error = {"error", "recipient does not exist"};
-      res.set_content(error.dump(), "application/json");
+      reply(req, res, error);
       return;
     }
 
-    Message msg(username, to, subject, body, generateToken());
-    if (db.createMessage(msg)) {
+    Message msg(*username, std::move(to), std::move(subject), std::move(body),
+                generateToken());
+    auto shard = shards.route(msg.to);
+    if (shard.writes.run([&] { return shard.db.createMessage(msg); })) {
+      cache.messageCreated(msg);
       res.status = 200;
-      res.set_content(R"({"status": "message sent."})", "application/json");
+      reply(req, res, {{"status", "message sent."}});
     } else {
       res.status = 500;
       json error = {{"error", "failed to create message"}};
-      res.set_content(error.dump(), "application/json");
+      reply(req, res, error);
     }
-  });
+  }));
 
-  svr.Post("/api/delmsg", [&db, &sessions](const auto &req, auto &res) {
-    std::string auth = req.get_header_value("Authorization");
-
-    if (auth.empty() || auth.substr(0, 7) != "Bearer ") {
-      res.status = 401;
+  svr.Post("/api/delmsg",
+           admitted(admission, "delmsg", {Priority::Normal, 16, 100ms},
+                    [&shards, &sessions, &cache](const auto &req, auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
       return;
-    }
 
-    std::string token = auth.substr(7);
-    auto it = sessions.find(token);
-    if (it == sessions.end()) {
-      res.status = 401;
-      json msg = {"error", "session expired"};
-      res.set_content(msg.dump(), "application/json");
-      return;
-    }
     std::string id;
-    try {
-      auto data = json::parse(req.body);
-      id = data["id"];
-    } catch (json::parse_error &e) {
+    auto error = FieldReader().string("id", id).read(req);
+    if (error) {
       res.status = 400;
-      json error = {"error", "failed to parse JSON"};
-      res.set_content(error.dump(), "application/json");
+      json response = {{"error", *error}};
+      reply(req, res, response);
       return;
     }
 
-    std::string username = it->second;
-
-    if (db.deleteMessage(username, id)) {
+    auto shard = shards.route(*username);
+    if (shard.writes.run(
+            [&] { return shard.db.deleteMessage(*username, id); })) {
+      cache.messageDeleted(*username, id);
       res.status = 200;
-      res.set_content("{\"status\": \"Success\"}", "application/json");
+      reply(req, res, {{"status", "Success"}});
       return;
     } else {
       res.status = 404;
       json error = {{"error", "message not found"}};
-      res.set_content(error.dump(), "application/json");
-      return;
-    }
-  });
-
-  svr.Post("/api/delusr", [&db, &sessions](const auto &req, auto &res) {
-    std::string auth = req.get_header_value("Authorization");
-
-    if (auth.empty() || auth.substr(0, 7) != "Bearer ") {
-      res.status = 401;
+      reply(req, res, error);
       return;
     }
+  }));
 
-    std::string token = auth.substr(7);
-    auto it = sessions.find(token);
-    if (it == sessions.end()) {
-      res.status = 401;
-      json msg = {"error", "session expired"};
-      res.set_content(msg.dump(), "application/json");
+  svr.Post("/api/delusr",
+           admitted(admission, "delusr", {Priority::Low, 4, 0ms},
+                    [&shards, &sessions, &cache](const auto &req, auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
       return;
-    }
 
-    std::string username = it->second;
-
-    if (db.deleteUser(username)) {
-      for (auto it = sessions.begin(); it != sessions.end();) {
-        if (it->second == username)
-          it = sessions.erase(it);
-        else
-          ++it;
-      }
+    if (shards.deleteUser(*username)) {
+      cache.userDeleted(*username);
+      sessions.removeUser(*username);
 
       res.status = 200;
-      res.set_content("{\"status\": \"Success\"}", "application/json");
+      reply(req, res, {{"status", "Success"}});
       return;
     } else {
       res.status = 404;
       json error = {{"error", "User not found"}};
-      res.set_content(error.dump(), "application/json");
+      reply(req, res, error);
       return;
     }
-  });
+  }));
 
-  svr.Post("/api/lsusrs", [&db, &sessions](const auto &req, auto &res) {
-    std::string auth = req.get_header_value("Authorization");
+  svr.Post("/api/lsusrs",
+           admitted(admission, "lsusrs", {Priority::Low, 2, 0ms},
+                    [&db, &sessions, &pools](const auto &req, auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
+      return;
 
-    if (auth.empty() || auth.substr(0, 7) != "Bearer ") {
+    if (*username != "admin") {
       res.status = 401;
+      json msg = {{"error", "access denied"}};
+      reply(req, res, msg);
       return;
     }
 
-    std::string token = auth.substr(7);
-    auto it = sessions.find(token);
-    if (it == sessions.end()) {
+    auto arena = RequestArena::resource();
+    auto users = pools.reads.run([&] { return db.getUsers(arena); });
+    json response = {{"users", json::array()}};
+    for (const auto &user : users)
+      response["users"].push_back(std::string_view(user));
+    res.status = 200;
+    reply(req, res, response);
+  }));
+
+  svr.Post("/api/a_delusr",
+           admitted(admission, "a_delusr", {Priority::Low, 2, 0ms},
+                    [&shards, &sessions, &cache](const auto &req, auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
+      return;
+
+    if (*username != "admin") {
       res.status = 401;
-      json msg = {"error", "session expired"};
-      res.set_content(msg.dump(), "application/json");
+      json msg = {{"error", "access denied"}};
+      reply(req, res, msg);
       return;
     }
 
-    std::string username = it->second;
+    std::string uname_to_del;
 
-    if (username != "admin") {
-      res.status = 401;
-      json msg = {{"error", "access denied"}};
-      res.set_content(msg.dump(), "application/json");
+    auto error = FieldReader().string("uname", uname_to_del).read(req);
+    if (error) {
+      res.status = 400;
+      json response = {{"error", *error}};
+      reply(req, res, response);
       return;
     }
 
-    json response = {{"users", db.getUsers()}};
-    res.status = 200;
-    res.set_content(response.dump(), "application/json");
-  });
+    if (shards.deleteUser(uname_to_del)) {
+      cache.userDeleted(uname_to_del);
+      sessions.removeUser(uname_to_del);
 
-  svr.Post("/api/a_delusr", [&db, &sessions](const auto &req, auto &res) {
-    std::string auth = req.get_header_value("Authorization");
+      res.status = 200;
+      reply(req, res, {{"status", "Success"}});
+      return;
+    } else {
+      res.status = 404;
+      json error = {{"error", "User not found"}};
+      reply(req, res, error);
+      return;
+    }
+  }));
 
-    if (auth.empty() || auth.substr(0, 7) != "Bearer ") {
+  svr.Post("/api/a_backup",
+           admitted(admission, "a_backup", {Priority::Low, 2, 0ms},
+                    [&sessions, &backups](const auto &req, auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
+      return;
+
+    if (*username != "admin") {
       res.status = 401;
+      json msg = {{"error", "access denied"}};
+      reply(req, res, msg);
       return;
     }
 
-    std::string token = auth.substr(7);
-    auto it = sessions.find(token);
-    if (it == sessions.end()) {
-      res.status = 401;
-      json msg = {"error", "session expired"};
-      res.set_content(msg.dump(), "application/json");
+    if (!Backups::supported()) {
+      res.status = 501;
+      json error = {{"error", "backups need MAIL_DB_ENGINE=sqlite"}};
+      reply(req, res, error);
       return;
     }
 
-    std::string username = it->second;
+    json response = {{"started", false}};
+    if (auto id = backups.start()) {
+      res.status = 202;
+      response["started"] = true;
+    } else {
+      res.status = 409;
+      response["error"] = "a backup is already running";
+    }
+    response["backup"] = backups.stats();
+    reply(req, res, response);
+  }));
+
+  // Streams one shard of a completed backup, the newest unless an id is
+  // given.
+  svr.Post("/api/a_snapshot",
+           admitted(admission, "a_snapshot", {Priority::Low, 2, 0ms},
+                    [&sessions, &backups](const auto &req, auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
+      return;
 
-    if (username != "admin") {
+    if (*username != "admin") {
       res.status = 401;
       json msg = {{"error", "access denied"}};
-      res.set_content(msg.dump(), "application/json");
+      reply(req, res, msg);
+      return;
     }
 
-    std::string uname_to_del;
-
-    try {
-      auto data = json::parse(req.body);
-      uname_to_del = data["uname"];
-    } catch (json::parse_error &e) {
+    std::string id;
+    int shard = 0;
+    auto error =
+        FieldReader().string("id", id, false).integer("shard", shard).read(req);
+    if (error) {
       res.status = 400;
-      json error = {{"error", "failed to parse JSON"}};
-      res.set_content(error.dump(), "application/json");
+      json response = {{"error", *error}};
+      reply(req, res, response);
       return;
     }
 
-    if (db.deleteUser(uname_to_del)) {
-      for (auto it = sessions.begin(); it != sessions.end();) {
-        if (it->second == username)
-          it = sessions.erase(it);
-        else
-          ++it;
-      }
+    if (id.empty()) {
+      auto ids = backups.snapshots();
+      if (!ids.empty())
+        id = ids.back();
+    }
+    auto path = shard >= 0 ? backups.file(id, shard) : std::nullopt;
+    int fd = path ? ::open(path->c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0)
+        close(fd);
+      res.status = 404;
+      json response = {{"error", "no such snapshot"}};
+      reply(req, res, response);
+      return;
+    }
 
-      res.status = 200;
-      res.set_content("{\"status\": \"Success\"}", "application/json");
+    // The descriptor lives as long as the response, so a snapshot deleted
+    // mid-download still streams whole.
+    std::shared_ptr<int> file(new int(fd), [](int *fd) {
+      close(*fd);
+      delete fd;
+    });
+    res.status = 200;
+    res.set_header("Content-Disposition",
+                   "attachment; filename=\"" + id + "-" +
+                       path->filename().string() + "\"");
+    res.set_content_provider(
+        st.st_size, "application/vnd.sqlite3",
+        [file](size_t offset, size_t length, httplib::DataSink &sink) {
+          char chunk[64 * 1024];
+          ssize_t n = pread(*file, chunk, std::min(length, sizeof(chunk)),
+                            offset);
+          return n > 0 && sink.write(chunk, n);
+        });
+  }));
+
+  svr.Post("/api/metrics", [&shards, &sessions, &pools, &admission, &rate_rules,
+                            &cache, &assets, &hasher, &backups, worker,
+                            workers](const auto &req, auto &res) {
+    auto username = authenticate(sessions, req, res);
+    if (!username)
       return;
-    } else {
-      res.status = 404;
-      json error = {{"error", "User not found"}};
-      res.set_content(error.dump(), "application/json");
+
+    if (*username != "admin") {
+      res.status = 401;
+      json msg = {{"error", "access denied"}};
+      reply(req, res, msg);
       return;
     }
+
+    json storage = shards.stats();
+    json response = {{"admission", admission.stats()},
+                     {"executors",
+                      {{"db-read", pools.reads.stats()},
+                       {"db-write", pools.writes.stats()},
+                       {"cpu", pools.cpu.stats()},
+                       {"hashing", pools.hashing.stats()}}},
+                     {"password_hash", hasher.stats()},
+                     {"process",
+                      {{"worker", worker},
+                       {"workers", workers},
+                       {"pid", getpid()}}},
+                     {"sessions", sessions.stats()},
+                     {"inbox_cache", cache.stats()},
+                     {"message_bodies", storage["message_bodies"]},
+                     {"db_shards", storage["shards"]},
+                     {"backup", backups.stats()},
+                     {"request_arena", RequestArena::stats()},
+                     {"static_assets", assets.stats()},
+                     {"rate_limits", json::object()}};
+    for (const auto &rule : rate_rules)
+      response["rate_limits"][rule.limiter->getName()] = rule.limiter->stats();
+    res.status = 200;
+    reply(req, res, response);
   });
 
+  std::thread([&svr, stop_signals] {
+    int signal;
+    sigwait(&stop_signals, &signal);
+    svr.stop();
+  }).detach();
+
   std::cout << "Server running on http://localhost:8080\n";
   svr.listen("0.0.0.0", 8080);
 }
@@ -1,19 +1,27 @@
+let inbox_etag = null;
+
 async function refresh() {
   let token = localStorage.getItem("token");
   if (token == null) {console.log("not logged in"); window.location.href = "/login.html"; return;}
 
-  let msgslist = document.getElementById("msgslist");
-  msgslist.innerHTML = "";
+  if (document.getElementById("input-search").value.trim() != "") return;
+  document.getElementById("search-pages").innerHTML = "";
 
+  let headers = {
+    'Content-Type': 'application/json',
+    'Authorization': 'Bearer ' + token,
+  };
+  if (inbox_etag != null) headers['If-None-Match'] = inbox_etag;
 
   const response = await fetch('/api/getmsgs', {
     method: 'POST',
-    headers: {
-      'Content-Type': 'application/json',
-      'Authorization': 'Bearer ' + token,
-    },
+    headers: headers,
   });
-  if (response.status == 401) {
+  if (response.status == 304) {
+    return;
+  }
+
+  else if (response.status == 401) {
     localStorage.removeItem('token');
     window.location.href = '/login.html';
     return;
@@ -27,30 +35,41 @@ async function refresh() {
 
   console.log(data);
 
+  inbox_etag = response.headers.get('ETag');
+
+  let msgslist = document.getElementById("msgslist");
+  msgslist.innerHTML = "";
+
   if (response.ok) {
     for (const message of data.messages) {
-      let div = document.createElement("div");
-      div.className = "msg-div"
-      let txt = document.createElement("p");
-      txt.innerHTML = `(${message.from}) Subject: ${message.subject}`;
-      txt.style.display = "inline-block";
-      txt.className = "msg-title";
-
-      let btn = document.createElement("button");
-      btn.innerHTML = "Hide";
-      btn.className = "view-msg-button";
-
-      let btn2 = document.createElement("button");
-      btn2.innerHTML = "Delete";
-      btn2.className = "delete-msg-button";
-
-      let body_txt_div = document.createElement("div");
-      let body_txt = document.createElement("p");
-      body_txt.innerHTML = message.body;
-      body_txt_div.appendChild(body_txt);
-      body_txt_div.style.display = "block";
-
-      btn.addEventListener("click", (async () => {
+      msgslist.appendChild(render_message(message, token));
+    };
+  }
+}
+
+function render_message(message, token) {
+  let div = document.createElement("div");
+  div.className = "msg-div"
+  let txt = document.createElement("p");
+  txt.innerHTML = `(${message.from}) Subject: ${message.subject}`;
+  txt.style.display = "inline-block";
+  txt.className = "msg-title";
+
+  let btn = document.createElement("button");
+  btn.innerHTML = "Hide";
+  btn.className = "view-msg-button";
+
+  let btn2 = document.createElement("button");
+  btn2.innerHTML = "Delete";
+  btn2.className = "delete-msg-button";
+
+  let body_txt_div = document.createElement("div");
+  let body_txt = document.createElement("p");
+  body_txt.innerHTML = message.body;
+  body_txt_div.appendChild(body_txt);
+  body_txt_div.style.display = "block";
+
+  btn.addEventListener("click", (async () => {
 	if (body_txt_div.style.display === "none") {
 	  body_txt_div.style.display = "block";
 	  btn.innerHTML = "Hide";
@@ -59,10 +78,10 @@ async function refresh() {
 	  body_txt_div.style.display = "none";
 	  btn.innerHTML = "View";
 	}
-      }
-      ));
+  }
+  ));
 
-      btn2.addEventListener("click", (async () => {
+  btn2.addEventListener("click", (async () => {
 	const res = await fetch("/api/delmsg", {
 	  method: "POST",
 	  headers: {
@@ -78,20 +97,73 @@ async function refresh() {
 	if (res.ok) {
 	  div.remove();
 	}
-        if (res.status == 401) {
+    if (res.status == 401) {
 	  localStorage.removeItem('token');
 	    window.location.href = '/login.html';
 	    return;
 	}
-      }));
-
-      body_txt_div.className = "msg-body";
-      div.appendChild(txt);
-      div.appendChild(btn);
-      div.appendChild(btn2);
-      div.appendChild(body_txt_div);
-      msgslist.appendChild(div);
-    };
+  }));
+
+  body_txt_div.className = "msg-body";
+  div.appendChild(txt);
+  div.appendChild(btn);
+  div.appendChild(btn2);
+  div.appendChild(body_txt_div);
+  return div;
+}
+
+async function search(offset = 0) {
+  let token = localStorage.getItem("token");
+  if (token == null) {window.location.href = "/login.html"; return;}
+
+  let query = document.getElementById("input-search").value.trim();
+  if (query == "") {refresh(); return;}
+
+  const response = await fetch('/api/search', {
+    method: 'POST',
+    headers: {
+      'Content-Type': 'application/json',
+      'Authorization': 'Bearer ' + token,
+    },
+    body: JSON.stringify({
+      'query': query,
+      'offset': offset,
+      'limit': 20
+    })
+  });
+  if (response.status == 401) {
+    localStorage.removeItem('token');
+    window.location.href = '/login.html';
+    return;
+  }
+
+  else if (!response.ok) {
+    throw new Error("Search failed.");
+  }
+
+  const data = await response.json();
+
+  inbox_etag = null;
+
+  let msgslist = document.getElementById("msgslist");
+  msgslist.innerHTML = "";
+  for (const message of data.messages) {
+    msgslist.appendChild(render_message(message, token));
+  }
+
+  let pages = document.getElementById("search-pages");
+  pages.innerHTML = "";
+  if (offset > 0) {
+    let prev = document.createElement("button");
+    prev.innerHTML = "Previous";
+    prev.addEventListener("click", () => search(Math.max(0, offset - data.limit)));
+    pages.appendChild(prev);
+  }
+  if (data.has_more) {
+    let next = document.createElement("button");
+    next.innerHTML = "Next";
+    next.addEventListener("click", () => search(offset + data.limit));
+    pages.appendChild(next);
   }
 }
 